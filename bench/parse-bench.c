@@ -0,0 +1,97 @@
+/*
+ * Parser microbenchmark: a request trickling in a few bytes per read is
+ * parsed again after every read, either rescanning the whole buffer
+ * (last_len 0) or only the new bytes (last_len as in http_conn_parse).
+ *
+ *   $ make bench
+ *   $ ./bench/parse-bench [headers] [fragment bytes] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "picohttpparser.h"
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char* build_request(int nheaders, size_t* len) {
+    size_t size = 64 + nheaders * 128;
+    char* req = malloc(size);
+    int i;
+
+    *len = sprintf(req, "GET /some-key HTTP/1.1\r\nHost: localhost\r\n");
+    for (i = 0; i < nheaders; i++) {
+        *len += sprintf(req + *len,
+            "X-Header-%d: %064d\r\n", i, i);
+    }
+    *len += sprintf(req + *len, "\r\n");
+
+    return req;
+}
+
+/* feed req frag bytes at a time, returns the number of parse calls */
+static int parse_fragmented(const char* req, size_t len, size_t frag, int incremental) {
+    const char* method;
+    const char* path;
+    size_t method_len, path_len;
+    int minor_version;
+    struct phr_header headers[128];
+    size_t num_headers;
+    size_t used = 0, last_len = 0;
+    int calls = 0;
+    int r;
+
+    do {
+        used = used + frag < len ? used + frag : len;
+        num_headers = 128;
+        r = phr_parse_request(req, used, &method, &method_len, &path, &path_len,
+            &minor_version, headers, &num_headers, incremental ? last_len : 0);
+        last_len = used;
+        calls++;
+    } while (-2 == r);
+
+    if (r != (int)len) {
+        fprintf(stderr, "parse error: %d\n", r);
+        exit(1);
+    }
+    return calls;
+}
+
+int main(int argc, char** argv) {
+    int nheaders   = argc > 1 ? atoi(argv[1]) : 40;
+    size_t frag    = argc > 2 ? strtoul(argv[2], NULL, 10) : 16;
+    int iterations = argc > 3 ? atoi(argv[3]) : 2000;
+    size_t len;
+    int i, calls = 0;
+
+    if (nheaders > 120) nheaders = 120;
+    if (frag < 1) frag = 1;
+
+    char* req = build_request(nheaders, &len);
+    printf("request: %zu bytes, %d headers, %zu byte fragments\n", len, nheaders + 1, frag);
+
+    double t = now();
+    for (i = 0; i < iterations; i++) {
+        calls = parse_fragmented(req, len, frag, 0);
+    }
+    double rescan = now() - t;
+
+    t = now();
+    for (i = 0; i < iterations; i++) {
+        parse_fragmented(req, len, frag, 1);
+    }
+    double incremental = now() - t;
+
+    printf("%d parses per request\n", calls);
+    printf("rescan:      %8.2f us/request\n", rescan * 1e6 / iterations);
+    printf("incremental: %8.2f us/request (%.1fx)\n",
+        incremental * 1e6 / iterations, rescan / incremental);
+
+    free(req);
+    return 0;
+}
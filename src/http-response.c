@@ -0,0 +1,269 @@
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-response.h"
+
+typedef struct {
+    const char* ptr;
+    size_t len;
+} http_block_t;
+
+#define BLOCK(s) { s, sizeof(s) - 1 }
+
+/* indexed by minor_version, then keepalive */
+#define STATUS_BLOCKS(status)                                                  \
+    {                                                                          \
+        { BLOCK("HTTP/1.0 " status "\r\n"),                                    \
+          BLOCK("HTTP/1.0 " status "\r\nConnection: keep-alive\r\n") },        \
+        { BLOCK("HTTP/1.1 " status "\r\nConnection: close\r\n"),               \
+          BLOCK("HTTP/1.1 " status "\r\n") },                                  \
+    }
+
+static const http_block_t STATUS[HTTP_STATUS_MAX][2][2] = {
+    STATUS_BLOCKS("200 OK"),
+    STATUS_BLOCKS("204 No Content"),
+    STATUS_BLOCKS("206 Partial Content"),
+    STATUS_BLOCKS("304 Not Modified"),
+    STATUS_BLOCKS("400 Bad Request"),
+    STATUS_BLOCKS("404 Not Found"),
+    STATUS_BLOCKS("411 Length Required"),
+    STATUS_BLOCKS("413 Payload Too Large"),
+    STATUS_BLOCKS("416 Range Not Satisfiable"),
+    STATUS_BLOCKS("502 Bad Gateway"),
+    STATUS_BLOCKS("503 Service Unavailable"),
+    STATUS_BLOCKS("504 Gateway Timeout"),
+};
+
+/* bodies of http_response_text_body */
+static const http_block_t REASON[HTTP_STATUS_MAX] = {
+    BLOCK("OK"),
+    BLOCK("No Content"),
+    BLOCK("Partial Content"),
+    BLOCK("Not Modified"),
+    BLOCK("Bad Request"),
+    BLOCK("Not Found"),
+    BLOCK("Length Required"),
+    BLOCK("Payload Too Large"),
+    BLOCK("Range Not Satisfiable"),
+    BLOCK("Bad Gateway"),
+    BLOCK("Service Unavailable"),
+    BLOCK("Gateway Timeout"),
+};
+
+static const http_block_t TEXT_PLAIN = BLOCK("Content-Type: text/plain\r\n");
+static const http_block_t CONTENT_LENGTH = BLOCK("Content-Length: ");
+static const http_block_t CONTENT_RANGE  = BLOCK("Content-Range: bytes ");
+
+static const char DIGITS[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* unaligned loads in native byte order */
+static uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc  = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh64_round(0, v);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t http_etag_hash(const char* data, size_t len) {
+    const unsigned char* p   = (const unsigned char*)data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        /* four independent lanes keep the multipliers busy */
+        uint64_t v1 = PRIME64_1 + PRIME64_2;
+        uint64_t v2 = PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else {
+        h = PRIME64_5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h  = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h  = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h  = ROTL64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+void http_date_init(http_date_t* date) {
+    date->sec = -1;
+    date->hdr_len = 0;
+}
+
+void http_date_update(http_date_t* date, time_t now) {
+    struct tm tm;
+
+    if (now == date->sec) return;
+    date->sec = now;
+
+    gmtime_r(&now, &tm);
+    date->hdr_len = strftime(date->hdr, sizeof(date->hdr),
+        "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+
+size_t http_u64toa(char* p, uint64_t n) {
+    char buf[20];
+    char* end = buf + sizeof(buf);
+    char* s   = end;
+
+    /* two digits at a time */
+    while (n >= 100) {
+        unsigned int i = (unsigned int)(n % 100) * 2;
+        n /= 100;
+        *--s = DIGITS[i + 1];
+        *--s = DIGITS[i];
+    }
+    if (n >= 10) {
+        unsigned int i = (unsigned int)n * 2;
+        *--s = DIGITS[i + 1];
+        *--s = DIGITS[i];
+    }
+    else {
+        *--s = '0' + (char)n;
+    }
+
+    memcpy(p, s, end - s);
+    return end - s;
+}
+
+size_t http_response_format_content_length(char* p, uint64_t len) {
+    size_t n = CONTENT_LENGTH.len;
+
+    memcpy(p, CONTENT_LENGTH.ptr, n);
+    n += http_u64toa(p + n, len);
+    memcpy(p + n, "\r\n\r\n", 4);
+
+    return n + 4;
+}
+
+size_t http_response_format_content_range(char* p, uint64_t first, uint64_t last, uint64_t total) {
+    size_t n = CONTENT_RANGE.len;
+
+    memcpy(p, CONTENT_RANGE.ptr, n);
+    if (first > last) {
+        p[n++] = '*';
+    }
+    else {
+        n += http_u64toa(p + n, first);
+        p[n++] = '-';
+        n += http_u64toa(p + n, last);
+    }
+    p[n++] = '/';
+    n += http_u64toa(p + n, total);
+    memcpy(p + n, "\r\n", 2);
+
+    return n + 2;
+}
+
+void http_response_append(http_response_t* resp, const char* data, size_t len) {
+    assert(resp->n < HTTP_RESPONSE_MAX_IOV);
+
+    resp->v[resp->n].iov_base = (char*)data;
+    resp->v[resp->n].iov_len  = len;
+    resp->n++;
+}
+
+void http_response_header(http_response_t* resp, const char* hdr, size_t len) {
+    http_response_append(resp, hdr, len);
+}
+
+void http_response_init(http_response_t* resp, int status, int minor_version, int keepalive,
+        const http_date_t* date) {
+    const http_block_t* b = &STATUS[status][minor_version ? 1 : 0][keepalive ? 1 : 0];
+
+    resp->n = 0;
+    http_response_append(resp, b->ptr, b->len);
+    if (date && date->hdr_len) {
+        http_response_append(resp, date->hdr, date->hdr_len);
+    }
+}
+
+void http_response_content_length(http_response_t* resp, uint64_t len) {
+    http_response_append(resp, resp->content_length,
+        http_response_format_content_length(resp->content_length, len));
+}
+
+void http_response_format_etag(char* p, uint64_t hash) {
+    int i;
+
+    memcpy(p, "ETag: \"", 7);
+    for (i = 0; i < 16; i++) {
+        p[7 + i] = "0123456789abcdef"[(hash >> (60 - 4 * i)) & 0xf];
+    }
+    memcpy(p + 23, "\"\r\n", 3);
+}
+
+void http_response_etag(http_response_t* resp, uint64_t hash) {
+    http_response_format_etag(resp->etag, hash);
+    http_response_append(resp, resp->etag, HTTP_ETAG_LEN);
+}
+
+void http_response_text_body(http_response_t* resp, int status) {
+    http_response_header(resp, TEXT_PLAIN.ptr, TEXT_PLAIN.len);
+    http_response_content_length(resp, REASON[status].len);
+    http_response_append(resp, REASON[status].ptr, REASON[status].len);
+}
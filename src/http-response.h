@@ -0,0 +1,92 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/*
+ * Response encoder: a response is a short iovec list of precomputed header
+ * blocks, the cached Date header, a formatted Content-Length and the body,
+ * ready for writev.
+ */
+
+enum {
+    HTTP_STATUS_OK,
+    HTTP_STATUS_NO_CONTENT,
+    HTTP_STATUS_PARTIAL_CONTENT,
+    HTTP_STATUS_NOT_MODIFIED,
+    HTTP_STATUS_BAD_REQUEST,
+    HTTP_STATUS_NOT_FOUND,
+    HTTP_STATUS_LENGTH_REQUIRED,
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,
+    HTTP_STATUS_BAD_GATEWAY,
+    HTTP_STATUS_SERVICE_UNAVAILABLE,
+    HTTP_STATUS_GATEWAY_TIMEOUT,
+    HTTP_STATUS_MAX
+};
+
+#define HTTP_RESPONSE_MAX_IOV 8
+
+/* "Date: ...\r\n", formatted at most once per second */
+typedef struct http_date_s {
+    time_t sec;
+    char hdr[sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n")];
+    size_t hdr_len;
+} http_date_t;
+
+typedef struct http_response_s {
+    struct iovec v[HTTP_RESPONSE_MAX_IOV];
+    int n;
+    char content_length[sizeof("Content-Length: 18446744073709551615\r\n\r\n")];
+    char etag[sizeof("ETag: \"0123456789abcdef\"\r\n")];
+} http_response_t;
+
+#define HTTP_ETAG_LEN (sizeof(((http_response_t*)0)->etag) - 1)
+
+#define HTTP_CONTENT_RANGE_MAX \
+    sizeof("Content-Range: bytes 18446744073709551615-18446744073709551615/18446744073709551615\r\n")
+
+void http_date_init(http_date_t* date);
+void http_date_update(http_date_t* date, time_t now);
+
+/* decimal digits of n into p, returns their count (at most 20) */
+size_t http_u64toa(char* p, uint64_t n);
+
+/* XXH64 of data, the entity tag of a value */
+uint64_t http_etag_hash(const char* data, size_t len);
+
+/* status line, Connection header as needed for the version and Date */
+void http_response_init(http_response_t* resp, int status, int minor_version, int keepalive,
+    const http_date_t* date);
+
+/* further header lines, each ending in CRLF, kept by reference */
+void http_response_header(http_response_t* resp, const char* hdr, size_t len);
+
+/* ETag header for hash */
+void http_response_etag(http_response_t* resp, uint64_t hash);
+
+/* "ETag: \"HASH\"\r\n" into p, HTTP_ETAG_LEN bytes */
+void http_response_format_etag(char* p, uint64_t hash);
+
+/*
+ * "Content-Range: bytes FIRST-LAST/TOTAL\r\n" into p, with * in place of the
+ * range when first > last, returns its length
+ */
+size_t http_response_format_content_range(char* p, uint64_t first, uint64_t last, uint64_t total);
+
+/* Content-Length header and the blank line ending the headers */
+void http_response_content_length(http_response_t* resp, uint64_t len);
+
+/* Content-Type, Content-Length and the reason phrase as a text/plain body */
+void http_response_text_body(http_response_t* resp, int status);
+
+/* raw bytes kept by reference, the body or preformatted header tail */
+void http_response_append(http_response_t* resp, const char* data, size_t len);
+
+/* "Content-Length: N\r\n\r\n" into p, returns its length */
+size_t http_response_format_content_length(char* p, uint64_t len);
+
+#endif /* HTTP_RESPONSE_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* accept4 */
 #include <stdio.h>
 
 #include <ev.h>
@@ -10,11 +11,16 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "hiredis.h"
 #include "async.h"
@@ -25,6 +31,8 @@
 #include "buffer.h"
 #include "picohttpparser.h"
 
+#include "http-response.h"
+
 /* default options */
 static uint16_t http_port;
 static sds http_address;
@@ -32,78 +40,422 @@ static sds http_socket;
 static uint16_t redis_port;
 static sds redis_address;
 static sds redis_socket;
+static size_t http_write_hwm;
+static int http_workers;
+static int http_threads;
+static int redis_connections;
+static int redis_mget_batch;
+static int redis_mget_window_us;
+static size_t cache_size;
+static int cache_ttl_ms;
+static int cache_tracking;
+static int http_max_connections;
+static int http_backlog;
+static int http_accept_batch;
+static size_t redis_stream_threshold;
+static int http_header_timeout;
+static int http_idle_timeout;
+static int redis_timeout_ms;
+static int http_defer_writes;
+static int http_etag;
 
 typedef struct http_server_s http_server_t;
 typedef struct http_conn_s http_conn_t;
+typedef struct http_req_s http_req_t;
+typedef struct http_chunk_s http_chunk_t;
+typedef struct http_conn_slab_s http_conn_slab_t;
+typedef struct http_listener_s http_listener_t;
+typedef struct http_listen_s http_listen_t;
+typedef struct redis_conn_s redis_conn_t;
+typedef struct redis_batch_s redis_batch_t;
+typedef struct redis_mget_s redis_mget_t;
+typedef struct redis_range_s redis_range_t;
+typedef struct redis_hash_s redis_hash_t;
+typedef struct redis_flight_s redis_flight_t;
+typedef struct cache_slot_s cache_slot_t;
+typedef struct cache_entry_s cache_entry_t;
+typedef struct redis_stream_s redis_stream_t;
+typedef struct redis_stream_hint_s redis_stream_hint_t;
+typedef struct redis_upload_s redis_upload_t;
 
-/* global server */
-static http_server_t* instance;
+struct redis_conn_s {
+    redisAsyncContext* context;
+    int connected;
+    int inflight;
+    int tracking; /* CLIENT TRACKING enabled, or subscribed for the tracking connection */
+    ev_timer reconnect_timer;
 
-struct http_server_s {
+    http_server_t* server;
+};
+
+/*
+ * --cache-size: responses by key, one cache per event loop. Linear probing
+ * table of (hash, entry) pairs so a lookup mostly touches one cache line,
+ * entries are kept in LRU order and evicted by size.
+ */
+typedef struct cache_s {
+    cache_slot_t* slots;
+    size_t size; /* power of 2 */
+    size_t count;
+    size_t bytes;
+    ngx_queue_t lru; /* most recently used first */
+} cache_t;
+
+/*
+ * --listen: an address to accept connections on. Bound once and shared by
+ * every event loop when fd is set before the loops start, otherwise each
+ * loop binds its own SO_REUSEPORT socket.
+ */
+struct http_listener_s {
+    sds name;                     /* as given, for messages */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;                       /* -1 when not bound yet */
+    int backlog;                  /* 0 for --backlog */
+    int defer_accept;             /* TCP_DEFER_ACCEPT seconds */
+    int fastopen;                 /* TCP_FASTOPEN queue length */
+    int rcvbuf;                   /* SO_RCVBUF/SO_SNDBUF, inherited by accepted sockets */
+    int sndbuf;
+};
+
+static http_listener_t* http_listeners;
+static int http_nlisteners;
+
+/* a listener's socket in one event loop */
+struct http_listen_s {
+    ev_io ev_read;
     int fd;
+    http_listener_t* listener;
+    http_server_t* server;
+};
+
+/* one server per event loop, the SIGTERM handler notifies all of them */
+static http_server_t** http_servers;
+static int http_nservers;
+
+struct http_server_s {
+    struct ev_loop* loop;
+    pthread_t thread;
+
+    http_listen_t* listens; /* one per http_listeners */
+    int nlistens;
     ngx_queue_t connections;
-    ev_io ev_read;
-    ev_timer reconnect_timer;
+    int nconns;
+    int accept_paused;            /* --max-connections reached */
+    ngx_queue_t conn_pool;        /* closed http_conn_t kept for reuse */
+    http_conn_slab_t* conn_slabs;
+
+    /* connection timeouts, a hashed timing wheel driven by one ev_timer */
+    ngx_queue_t* wheel;
+    unsigned long wheel_tick;     /* last tick processed */
+    ev_tstamp wheel_epoch;
+    int ntimers;
+    ev_timer wheel_timer;
+    ev_async stop_async;
 
     int closing;
-    void* data;
+
+    http_date_t date;
+    uint64_t unique; /* see http_server_unique */
+
+    /* --redis-connections pool */
+    redis_conn_t* redis;
+    int nredis;
+
+    /* --defer-writes: connections with output to write before the loop blocks */
+    ngx_queue_t deferred;
+    ev_prepare write_prepare;
+
+    /* GETs waiting to go out as one MGET, see --mget-batch */
+    redis_batch_t* batch;
+    ev_prepare batch_prepare;
+    ev_timer batch_timer;
+
+    /* GETs sent to redis and not answered yet, by key */
+    redis_flight_t** flights;
+    size_t flights_size; /* power of 2 */
+    size_t nflights;
+
+    cache_t cache;
+    unsigned int cache_generation; /* bumped whenever the whole cache is dropped */
+
+    /* --cache-tracking: receives invalidations for keys read by the pool */
+    redis_conn_t tracking;
+    long long tracking_id;
+
+    /* --stream-threshold */
+    ngx_queue_t streams_idle;
+    int nstreams;
+    redis_stream_hint_t* stream_hints; /* keys last seen with a large value */
+
+    /* PUT and POST bodies on their way to redis */
+    ngx_queue_t uploads_idle;
+    int nuploads;
+};
+
+/* one GET in flight and every request waiting for its reply */
+struct redis_flight_s {
+    redis_flight_t* next;
+    unsigned int hash;
+    int nreqs;
+    int reqs_size;
+    http_req_t** reqs;
+    int cache;                 /* reply may be cached */
+    unsigned int generation;   /* cache generation when sent */
+    size_t key_len;
+    char key[];
+};
+
+struct cache_slot_s {
+    unsigned int hash;
+    cache_entry_t* entry;
+};
+
+struct cache_entry_s {
+    ngx_queue_t lru;
+    unsigned int hash;
+    int found;
+    uint64_t etag;   /* with --etag */
+    ev_tstamp expires;
+    size_t key_len;
+    size_t data_len; /* "ETag: ...\r\n" with --etag, "Content-Length: ...\r\n\r\n" and value */
+    char data[];     /* key, then data */
+};
+
+/*
+ * --stream-threshold: a plain redis connection carrying one GET at a time.
+ * Large values are forwarded to the client as they arrive, spliced through
+ * a pipe where possible, instead of being collected into a redisReply.
+ */
+struct redis_stream_s {
+    ngx_queue_t queue;      /* server->streams_idle */
+    redisContext* context;  /* only connects, reading and writing is done here */
+    int connected;
+    ev_io ev_read;
+    ev_io ev_write;
+    char* cmd;              /* GET not written yet */
+    size_t cmd_len;
+    size_t cmd_off;
+    buffer* rbuf;           /* reply header, or a whole small value */
+    int pipe[2];            /* -1 without splice */
+    http_req_t* req;
+    long long body_len;     /* -1 until the bulk header is read */
+    long long remaining;    /* value bytes and CRLF not forwarded yet */
+    int streaming;          /* response headers sent */
+    unsigned int hash;
+    http_server_t* server;
+};
+
+/* what redis_upload_feed expects next */
+static const int REDIS_UPLOAD_BODY       = 0; /* Content-Length bytes */
+static const int REDIS_UPLOAD_CHUNK_SIZE = 1; /* chunked: size line */
+static const int REDIS_UPLOAD_CHUNK_DATA = 2;
+static const int REDIS_UPLOAD_CHUNK_CRLF = 3;
+static const int REDIS_UPLOAD_TRAILER    = 4;
+static const int REDIS_UPLOAD_COMMIT     = 5; /* body read, waiting for the APPEND replies */
+static const int REDIS_UPLOAD_DONE       = 6; /* everything sent, waiting for the replies */
+
+/*
+ * PUT or POST of a key: a plain redis connection the request body is
+ * written to as it arrives. A Content-Length body is the value of one SET,
+ * a chunked one is APPENDed chunk by chunk to a temporary key that is
+ * renamed once all of it made it.
+ */
+struct redis_upload_s {
+    ngx_queue_t queue;      /* server->uploads_idle */
+    redisContext* context;  /* only connects, reading and writing is done here */
+    int connected;
+    ev_io ev_read;
+    ev_io ev_write;
+    buffer* wbuf;           /* bytes redis has not taken yet, from woff */
+    size_t woff;
+    buffer* rbuf;           /* replies */
+    http_req_t* req;        /* NULL once the request gave up on it */
+    int state;
+    int replies;            /* replies still expected */
+    int failed;             /* one of them was an error */
+    long long remaining;    /* bytes of the body or of the current chunk not read yet */
+    long long ttl;          /* seconds, 0 for none */
+    sds key;
+    sds tmp;                /* chunked: the key APPENDed to */
+    sds append;             /* chunked: APPEND command up to the chunk length */
+    http_server_t* server;
+};
+
+struct redis_stream_hint_s {
+    unsigned int hash;
+    sds key;
+};
+
+/* the MGET of a /_mget request, req is NULL once the request gave up on it */
+struct redis_mget_s {
+    http_req_t* req;
+    int binary; /* length-prefixed values instead of JSON */
+};
+
+/*
+ * The HGET, HMGET or HGETALL of a /h/ request, req is NULL once the request
+ * gave up on it. HMGET keeps its fields to name the values in the answer.
+ */
+struct redis_hash_s {
+    http_req_t* req;
+    int hget;
+    int argc;        /* 2 for HGETALL */
+    size_t* argvlen; /* HMGET: argvlen[2..argc) are the field lengths */
+    sds args;        /* HMGET: key and fields back to back */
+};
+
+/* Range header specs kept per request, more and the whole value is sent */
+#define HTTP_RANGES_MAX 8
+
+/* bytes FIRST-LAST, FIRST- with last -1, or the last LAST bytes with first -1 */
+typedef struct http_range_s {
+    long long first;
+    long long last;
+} http_range_t;
+
+/* the MULTI/EXEC of a Range GET, req is NULL once the request gave up on it */
+struct redis_range_s {
+    http_req_t* req;
+    int n;
+    http_range_t ranges[HTTP_RANGES_MAX];
+};
+
+struct redis_batch_s {
+    int n;
+    redis_flight_t** flights;
+    size_t* argvlen; /* argvlen[0] is "MGET" */
+    sds keys;        /* all keys back to back */
 };
 
 static const int HTTP_CONN_ERR        = 1 << 0;
-static const int HTTP_CONN_WAIT_REDIS = 1 << 1;
+static const int HTTP_CONN_LAST       = 1 << 1; /* no more requests accepted */
+static const int HTTP_CONN_CLOSE      = 1 << 2; /* close once output is drained */
+static const int HTTP_CONN_DEFERRED   = 1 << 3; /* in server->deferred */
+
+/* max pipelined requests per connection before reading is paused */
+static const size_t REDIS_FLIGHTS_INITIAL = 256;
+static const size_t CACHE_SLOTS_INITIAL   = 1024;
+static const int    REDIS_STREAM_MAX      = 64;        /* stream connections per loop */
+static const size_t REDIS_STREAM_HINTS    = 256;       /* power of 2 */
+static const size_t REDIS_STREAM_CHUNK    = 64 * 1024;
+static const int    REDIS_STREAM_BUDGET   = 16;        /* chunks forwarded per wakeup */
+static const int    REDIS_UPLOAD_MAX      = 64;        /* upload connections per loop */
+static const size_t REDIS_UPLOAD_HWM      = 256 * 1024; /* client reads pause beyond this backlog */
+static const int    REDIS_UPLOAD_TMP_TTL  = 3600;      /* seconds, temporary keys of failed uploads */
+
+static const int HTTP_CONN_MAX_PENDING = 128;
+static const size_t HTTP_CONN_SLAB        = 64;        /* connections allocated at once */
+static const size_t HTTP_CONN_RBUF_KEEP   = 16 * 1024; /* larger read buffers are shrunk on close */
+static const size_t CACHE_LINE_SIZE       = 64;
+
+static const unsigned long HTTP_WHEEL_SLOTS = 1024; /* power of 2 */
+static const ev_tstamp     HTTP_WHEEL_TICK  = 0.1;
+
+/* what the connection timer of http_conn_t is waiting for */
+static const int HTTP_TIMER_NONE   = 0;
+static const int HTTP_TIMER_IDLE   = 1; /* next request on a kept alive connection */
+static const int HTTP_TIMER_HEADER = 2; /* rest of a request */
+static const int HTTP_TIMER_REDIS  = 3; /* any redis reply while requests wait */
+static const size_t HTTP_CONN_READ_MIN    = 4096;       /* spare rbuf space for each read */
+static const size_t HTTP_CONN_READ_BUDGET = 256 * 1024; /* bytes read per wakeup */
+static const size_t HTTP_CONN_DEFER_MAX   = 64 * 1024;  /* --defer-writes: larger writes go out at once */
+static const long long HTTP_BODY_MAX      = 1024 * 1024; /* request bodies, /_mget key lists */
+
+/* header of a block of connections, each on its own cache lines */
+struct http_conn_slab_s {
+    http_conn_slab_t* next;
+};
 
 struct http_conn_s {
     int fd;
     ngx_queue_t queue;
     ev_io ev_read;
+    ev_io ev_write;
     buffer* rbuf;
+    size_t last_len;      /* bytes of the incomplete request at the start of rbuf already scanned */
 
     int flags;
 
+    ngx_queue_t timer;    /* in server->wheel when timer_phase is set */
+    int timer_phase;
+    unsigned long timer_expires;
+
+    ngx_queue_t output;   /* http_chunk_t not yet accepted by the socket */
+    size_t output_size;
+    ngx_queue_t deferred; /* in server->deferred with HTTP_CONN_DEFERRED */
+
+    redis_stream_t* stream; /* forwarding the value of the head request */
+    redis_upload_t* upload; /* last request, until its value is stored */
+
+    ngx_queue_t requests; /* in request order */
+    int nrequests;
+    int waiting;          /* requests waiting for redis */
+
     http_server_t* server;
 };
 
-static http_conn_t* http_conn_init(int fd);
+static const int HTTP_REQ_KEEPALIVE = 1 << 0;
+static const int HTTP_REQ_DONE      = 1 << 1;
+static const int HTTP_REQ_ETAG_ANY  = 1 << 2; /* If-None-Match: * */
+
+/* If-None-Match entity tags kept per request, more are ignored */
+#define HTTP_REQ_ETAGS 4
+
+struct http_req_s {
+    ngx_queue_t queue;
+    http_conn_t* conn;
+
+    int flags;
+    int minor_version;
+
+    redis_flight_t* flight; /* GET this request waits for */
+    redis_mget_t* mget;     /* or /_mget */
+    redis_range_t* range;   /* or a Range GET */
+    redis_hash_t* hash;     /* or /h/ */
+    redis_upload_t* upload; /* or PUT/POST */
+
+    uint64_t etags[HTTP_REQ_ETAGS]; /* --etag: If-None-Match */
+    int netags;
+
+    /* response held back until all earlier responses are written */
+    buffer* resp;
+};
+
+/* pending output, either an owned buffer or data stored inline after it */
+struct http_chunk_s {
+    ngx_queue_t queue;
+    char* ptr;
+    size_t len;
+    buffer* buf;
+};
+
+/* max iovecs per writev when draining the output queue */
+static const int HTTP_CONN_MAX_IOV = 64;
+
+static http_conn_t* http_conn_init(http_server_t* server, int fd);
 static void http_conn_close(http_conn_t* conn);
+static void http_conn_flush(http_conn_t* conn);
+static void http_server_stop(http_server_t* server);
+static void http_server_accept_pause(http_server_t* server);
+static void http_server_accept_resume(http_server_t* server);
 
 static void redis_connect_cb(const redisAsyncContext* c, int status);
 static void redis_disconnect_cb(const redisAsyncContext* c, int status);
-static void redis_reconnect(http_server_t* server);
-
-static const char* const BAD_REQUEST =
-    "HTTP/1.0 400 Bad Request\r\n"
-    "Content-Type: text/plain\r\n"
-    "Content-Length: 11\r\n"
-    "\r\n"
-    "Bad Request";
-static const size_t BAD_REQUEST_LEN = 85;
-
-static const char* const NOT_FOUND =
-    "HTTP/1.0 404 Not Found\r\n"
-    "Content-Type: text/plain\r\n"
-    "Content-Length: 9\r\n"
-    "\r\n"
-    "Not Found";
-static const size_t NOT_FOUND_LEN = 80;
-
-static const char* const BAD_GATEWAY =
-    "HTTP/1.0 502 Bad Gateway\r\n"
-    "Content-Type: text/plain\r\n"
-    "Content-Length: 11\r\n"
-    "\r\n"
-    "Bad Gateway";
-static const size_t BAD_GATEWAY_LEN = 85;
-
-static const char* const OK_HDR =
-    "HTTP/1.0 200 OK\r\n";
-static const size_t OK_HDR_LEN = 17;
+static void redis_reconnect(redis_conn_t* rc);
+static void redis_tracking_connected(redis_conn_t* rc);
+static void redis_tracking_lost(redis_conn_t* rc);
+static void redis_stream_hint(http_server_t* server, const char* key, size_t key_len, unsigned int hash, int large);
+static void redis_stream_resume(redis_stream_t* st);
+static void redis_stream_abort(redis_stream_t* st);
+static void redis_upload_abort(redis_upload_t* u);
 
 void usage() {
     fprintf(stderr,"Usage: ./redis-http --port 7777 --redis-port 8888\n");
     exit(1);
 }
 
-static redisAsyncContext* redis_connect(void) {
+static redisAsyncContext* redis_connect(redis_conn_t* rc) {
     redisAsyncContext* c;
     if (redis_socket) {
         c = redisAsyncConnectUnix(redis_socket);
@@ -118,377 +470,4276 @@ static redisAsyncContext* redis_connect(void) {
         return NULL;
     }
 
-    redisLibevAttach(EV_DEFAULT_ c);
+    c->data = (void*)rc;
+    redisLibevAttach(rc->server->loop, c);
     redisAsyncSetConnectCallback(c, redis_connect_cb);
     redisAsyncSetDisconnectCallback(c, redis_disconnect_cb);
 
-    return c;
-}
+    return c;
+}
+
+static void redis_reconnect_cb(EV_P_ ev_timer* w, int revents) {
+    ev_timer_stop(EV_A_ w);
+
+    redis_conn_t* rc = (redis_conn_t*)
+        (((char*)w) - offsetof(redis_conn_t, reconnect_timer));
+
+    rc->context = redis_connect(rc);
+    if (NULL == rc->context) {
+        redis_reconnect(rc);
+    }
+}
+
+static void redis_reconnect(redis_conn_t* rc) {
+    ev_timer_set(&rc->reconnect_timer, 2., 0.);
+    ev_timer_start(rc->server->loop, &rc->reconnect_timer);
+}
+
+static void redis_connect_cb(const redisAsyncContext* c, int status) {
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+
+    if (status != REDIS_OK) {
+        fprintf(stderr, "redis connect error: %s\n", c->errstr);
+        rc->context = NULL;
+        redis_reconnect(rc);
+        return;
+    }
+    printf("Connected redis-server (%s:%d)\n", redis_address, redis_port);
+
+    rc->connected = 1;
+    rc->inflight  = 0;
+    rc->tracking  = 0;
+
+    if (cache_tracking) {
+        redis_tracking_connected(rc);
+    }
+}
+
+static void redis_disconnect_cb(const redisAsyncContext* c, int status) {
+    if (status != REDIS_OK) {
+        fprintf(stderr, "redis error: %d %s\n", status, c->errstr);
+    }
+    else {
+        fprintf(stderr, "disconnected from redis\n");
+    }
+
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    rc->context   = NULL;
+    rc->connected = 0;
+
+    if (cache_tracking) {
+        redis_tracking_lost(rc);
+    }
+
+    if (0 == rc->server->closing)
+        redis_reconnect(rc);
+}
+
+/* connected redis connection with the fewest commands in flight */
+static redis_conn_t* redis_pick(http_server_t* server) {
+    redis_conn_t* best = NULL;
+    int i;
+
+    for (i = 0; i < server->nredis; i++) {
+        redis_conn_t* rc = &server->redis[i];
+        if (!rc->connected) continue;
+        if (NULL == best || rc->inflight < best->inflight) {
+            best = rc;
+            if (0 == best->inflight) break;
+        }
+    }
+    return best;
+}
+
+/* reading and dispatching pause while any of these hold */
+static int http_conn_readable(http_conn_t* conn) {
+    /*
+     * The body of an upload as fast as redis takes it, requests after it
+     * once the value is stored so they see it
+     */
+    if (conn->upload) {
+        return !(conn->flags & HTTP_CONN_ERR) && conn->upload->state < REDIS_UPLOAD_COMMIT
+            && conn->upload->wbuf->used - conn->upload->woff < REDIS_UPLOAD_HWM;
+    }
+    return !(conn->flags & (HTTP_CONN_ERR | HTTP_CONN_LAST | HTTP_CONN_CLOSE))
+        && conn->nrequests < HTTP_CONN_MAX_PENDING
+        && conn->output_size < http_write_hwm;
+}
+
+static unsigned long http_wheel_now(http_server_t* server) {
+    return (unsigned long)((ev_now(server->loop) - server->wheel_epoch) / HTTP_WHEEL_TICK);
+}
+
+/* (re)arm the connection timer, HTTP_TIMER_NONE or msec <= 0 disarms it */
+static void http_conn_timer_set(http_conn_t* conn, int phase, int msec) {
+    http_server_t* server = conn->server;
+
+    if (HTTP_TIMER_NONE != conn->timer_phase) {
+        ngx_queue_remove(&conn->timer);
+        conn->timer_phase = HTTP_TIMER_NONE;
+        if (0 == --server->ntimers) {
+            ev_timer_stop(server->loop, &server->wheel_timer);
+        }
+    }
+
+    if (HTTP_TIMER_NONE == phase || msec <= 0) return;
+
+    if (0 == server->ntimers++) {
+        server->wheel_tick = http_wheel_now(server);
+        ev_timer_again(server->loop, &server->wheel_timer);
+    }
+
+    unsigned long ticks = (unsigned long)(msec / (HTTP_WHEEL_TICK * 1000.)) + 1;
+    conn->timer_phase   = phase;
+    conn->timer_expires = http_wheel_now(server) + ticks;
+    ngx_queue_insert_tail(&server->wheel[conn->timer_expires & (HTTP_WHEEL_SLOTS - 1)],
+        &conn->timer);
+}
+
+/*
+ * Pick the timeout for what the connection is doing now. A running header
+ * or idle timer is left alone, so trickling in a request does not extend it.
+ */
+static void http_conn_timer_update(http_conn_t* conn) {
+    int phase, msec = 0;
+
+    if (conn->flags & HTTP_CONN_ERR) return;
+
+    if (conn->upload && conn->upload->state < REDIS_UPLOAD_COMMIT) {
+        /* rest of the body, re-armed by redis_upload_feed as it arrives */
+        phase = HTTP_TIMER_HEADER;
+        msec  = http_header_timeout * 1000;
+    }
+    else if (conn->waiting) {
+        phase = HTTP_TIMER_REDIS;
+        msec  = redis_timeout_ms;
+    }
+    else if (conn->nrequests || conn->output_size) {
+        phase = HTTP_TIMER_NONE;
+    }
+    else if (conn->rbuf->used) {
+        phase = HTTP_TIMER_HEADER;
+        msec  = http_header_timeout * 1000;
+    }
+    else {
+        phase = HTTP_TIMER_IDLE;
+        msec  = http_idle_timeout * 1000;
+    }
+
+    if (phase != conn->timer_phase) {
+        http_conn_timer_set(conn, phase, msec);
+    }
+}
+
+/*
+ * Have the output queue drained on EV_WRITE, or with --defer-writes once
+ * every callback of this loop iteration had its say, so the responses to a
+ * burst of redis replies leave in one writev per connection.
+ */
+static void http_conn_want_write(http_conn_t* conn) {
+    http_server_t* server = conn->server;
+
+    if (!http_defer_writes || ev_is_active(&conn->ev_write)) {
+        ev_io_start(server->loop, &conn->ev_write);
+        return;
+    }
+    if (conn->flags & HTTP_CONN_DEFERRED) return;
+
+    conn->flags = conn->flags | HTTP_CONN_DEFERRED;
+    ngx_queue_insert_tail(&server->deferred, &conn->deferred);
+    ev_prepare_start(server->loop, &server->write_prepare);
+}
+
+static void http_conn_queue_chunk(http_conn_t* conn, http_chunk_t* chunk) {
+    ngx_queue_insert_tail(&conn->output, &chunk->queue);
+    conn->output_size += chunk->len;
+
+    http_conn_want_write(conn);
+}
+
+/*
+ * --defer-writes: copy v to the end of the output queue, appending to the
+ * last chunk while it is a buffer of reasonable size. b, when given, holds
+ * the same bytes and is queued itself instead of starting a new buffer.
+ */
+static void http_conn_write_deferred(http_conn_t* conn, const struct iovec* v, int n,
+        size_t len, buffer* b) {
+    http_chunk_t* chunk = NULL;
+    size_t offset = 0, queued = 0;
+    int i;
+
+    if (!ngx_queue_empty(&conn->output)) {
+        chunk = ngx_queue_data(ngx_queue_last(&conn->output), http_chunk_t, queue);
+        if (NULL == chunk->buf || chunk->buf->used + len > HTTP_CONN_DEFER_MAX) {
+            chunk = NULL;
+        }
+    }
+
+    if (chunk) {
+        /* the chunk always ends where its buffer does */
+        queued = chunk->len;
+        offset = chunk->buf->used - chunk->len;
+    }
+    else {
+        chunk = malloc(sizeof(http_chunk_t));
+        assert(chunk);
+        chunk->buf = b ? b : buffer_init();
+        ngx_queue_insert_tail(&conn->output, &chunk->queue);
+    }
+
+    if (chunk->buf != b) {
+        buffer* buf = chunk->buf;
+        buffer_prepare_append(buf, len);
+        for (i = 0; i < n; i++) {
+            memcpy(buf->ptr + buf->used, v[i].iov_base, v[i].iov_len);
+            buf->used += v[i].iov_len;
+        }
+        if (b) buffer_free(b);
+    }
+
+    chunk->ptr = chunk->buf->ptr + offset;
+    chunk->len = chunk->buf->used - offset;
+    conn->output_size += chunk->len - queued;
+
+    http_conn_want_write(conn);
+}
+
+/*
+ * Write directly while nothing is queued, anything the socket does not take
+ * is copied to the output queue and drained by http_conn_write_cb. Fatal
+ * errors only mark the connection, callers close it.
+ */
+static void http_conn_write(http_conn_t* conn, const struct iovec* v, int n) {
+    ssize_t r = 0;
+    size_t rest = 0;
+    int i;
+
+    if (conn->flags & HTTP_CONN_ERR) return;
+
+    if (http_defer_writes) {
+        for (i = 0; i < n; i++) rest += v[i].iov_len;
+        if (rest < HTTP_CONN_DEFER_MAX || !ngx_queue_empty(&conn->output)) {
+            http_conn_write_deferred(conn, v, n, rest, NULL);
+            return;
+        }
+        rest = 0;
+    }
+
+    if (ngx_queue_empty(&conn->output)) {
+        r = writev(conn->fd, v, n);
+        if (-1 == r) {
+            if (EAGAIN != errno && EWOULDBLOCK != errno) {
+                conn->flags = conn->flags | HTTP_CONN_ERR;
+                return;
+            }
+            r = 0;
+        }
+    }
+
+    for (i = 0; i < n; i++) rest += v[i].iov_len;
+    rest -= r;
+    if (0 == rest) return;
+
+    http_chunk_t* chunk = malloc(sizeof(http_chunk_t) + rest);
+    assert(chunk);
+    chunk->ptr = (char*)(chunk + 1);
+    chunk->len = rest;
+    chunk->buf = NULL;
+
+    char* p = chunk->ptr;
+    for (i = 0; i < n; i++) {
+        if ((size_t)r >= v[i].iov_len) {
+            r -= v[i].iov_len;
+            continue;
+        }
+        memcpy(p, (char*)v[i].iov_base + r, v[i].iov_len - r);
+        p += v[i].iov_len - r;
+        r = 0;
+    }
+
+    http_conn_queue_chunk(conn, chunk);
+}
+
+/* same as http_conn_write but takes ownership of b instead of copying it */
+static void http_conn_write_buffer(http_conn_t* conn, buffer* b) {
+    ssize_t r = 0;
+
+    if (conn->flags & HTTP_CONN_ERR) {
+        buffer_free(b);
+        return;
+    }
+
+    if (http_defer_writes &&
+            (b->used < HTTP_CONN_DEFER_MAX || !ngx_queue_empty(&conn->output))) {
+        struct iovec v = { b->ptr, b->used };
+        http_conn_write_deferred(conn, &v, 1, b->used, b);
+        return;
+    }
+
+    if (ngx_queue_empty(&conn->output)) {
+        r = write(conn->fd, b->ptr, b->used);
+        if (-1 == r) {
+            if (EAGAIN != errno && EWOULDBLOCK != errno) {
+                conn->flags = conn->flags | HTTP_CONN_ERR;
+                buffer_free(b);
+                return;
+            }
+            r = 0;
+        }
+    }
+
+    if ((size_t)r == b->used) {
+        buffer_free(b);
+        return;
+    }
+
+    http_chunk_t* chunk = malloc(sizeof(http_chunk_t));
+    assert(chunk);
+    chunk->ptr = b->ptr + r;
+    chunk->len = b->used - r;
+    chunk->buf = b;
+
+    http_conn_queue_chunk(conn, chunk);
+}
+
+static void http_chunk_free(http_chunk_t* chunk) {
+    ngx_queue_remove(&chunk->queue);
+    if (chunk->buf) buffer_free(chunk->buf);
+    free(chunk);
+}
+
+/* write as much of the output queue as the socket takes */
+static void http_conn_drain(http_conn_t* conn) {
+    struct iovec v[HTTP_CONN_MAX_IOV];
+    int n = 0;
+    ngx_queue_t* q;
+
+    ngx_queue_foreach(q, &conn->output) {
+        if (n == HTTP_CONN_MAX_IOV) break;
+        http_chunk_t* chunk = ngx_queue_data(q, http_chunk_t, queue);
+        v[n].iov_base = chunk->ptr;
+        v[n].iov_len  = chunk->len;
+        n++;
+    }
+
+    ssize_t r = writev(conn->fd, v, n);
+    if (-1 == r) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) { /* try again later */
+            ev_io_start(conn->server->loop, &conn->ev_write);
+            return;
+        }
+#ifdef DEBUG
+        fprintf(stderr, "write error: %d, %s\n", errno, strerror(errno));
+#endif
+        http_conn_close(conn);
+        return;
+    }
+
+    conn->output_size -= r;
+    while (r > 0) {
+        http_chunk_t* chunk = ngx_queue_data(ngx_queue_head(&conn->output),
+            http_chunk_t, queue);
+        if ((size_t)r < chunk->len) {
+            chunk->ptr += r;
+            chunk->len -= r;
+            break;
+        }
+        r -= chunk->len;
+        http_chunk_free(chunk);
+    }
+
+    if (!ngx_queue_empty(&conn->output)) {
+        ev_io_start(conn->server->loop, &conn->ev_write);
+        if (conn->output_size >= http_write_hwm) return;
+    }
+    else {
+        ev_io_stop(conn->server->loop, &conn->ev_write);
+    }
+
+    /* close after the last byte, or resume reading below the high-water mark */
+    http_conn_flush(conn);
+}
+
+static void http_conn_write_cb(EV_P_ ev_io* w, int revents) {
+    http_conn_t* conn = (http_conn_t*)
+        (((char*)w) - offsetof(http_conn_t, ev_write));
+    http_conn_drain(conn);
+}
+
+static void http_conn_write_prepare_cb(EV_P_ ev_prepare* w, int revents) {
+    http_server_t* server = (http_server_t*)
+        (((char*)w) - offsetof(http_server_t, write_prepare));
+
+    /* draining may answer more requests and defer their output again */
+    while (!ngx_queue_empty(&server->deferred)) {
+        ngx_queue_t* q = ngx_queue_head(&server->deferred);
+        http_conn_t* conn = ngx_queue_data(q, http_conn_t, deferred);
+        ngx_queue_remove(q);
+        conn->flags = conn->flags & ~HTTP_CONN_DEFERRED;
+
+        if (conn->flags & HTTP_CONN_ERR) continue;
+        http_conn_drain(conn);
+    }
+
+    ev_prepare_stop(EV_A_ w);
+}
+
+static http_req_t* http_req_init(http_conn_t* conn, int minor_version, int keepalive) {
+    http_req_t* req = malloc(sizeof(http_req_t));
+    assert(req);
+
+    req->conn  = conn;
+    req->flags = keepalive ? HTTP_REQ_KEEPALIVE : 0;
+    req->minor_version = minor_version >= 1 ? 1 : 0;
+    req->resp  = NULL;
+    req->flight = NULL;
+    req->mget   = NULL;
+    req->range  = NULL;
+    req->hash   = NULL;
+    req->upload = NULL;
+    req->netags = 0;
+
+    ngx_queue_insert_tail(&conn->requests, &req->queue);
+    conn->nrequests++;
+
+    return req;
+}
+
+static void http_req_free(http_req_t* req) {
+    ngx_queue_remove(&req->queue);
+    req->conn->nrequests--;
+
+    if (req->resp) buffer_free(req->resp);
+    free(req);
+}
+
+/* start the response to req, no more keep-alive once the server is closing */
+static void http_req_response_init(http_req_t* req, http_response_t* resp, int status) {
+    http_server_t* server = req->conn->server;
+
+    if (server->closing) {
+        req->flags = req->flags & ~HTTP_REQ_KEEPALIVE;
+    }
+
+    http_date_update(&server->date, (time_t)ev_now(server->loop));
+    http_response_init(resp, status, req->minor_version,
+        req->flags & HTTP_REQ_KEEPALIVE, &server->date);
+}
+
+/*
+ * Complete a request with the given response, leaving flushing to the
+ * caller. Responses go out in request order, so unless this is the oldest
+ * request the data is copied and kept until http_conn_flush gets to it.
+ */
+static void http_req_set_response(http_req_t* req, const struct iovec* v, int n) {
+    http_conn_t* conn = req->conn;
+    int i;
+
+    req->flags = req->flags | HTTP_REQ_DONE;
+
+    if (ngx_queue_head(&conn->requests) == &req->queue) {
+        http_conn_write(conn, v, n);
+    }
+    else {
+        req->resp = buffer_init();
+        for (i = 0; i < n; i++) {
+            buffer_prepare_append(req->resp, v[i].iov_len);
+            memcpy(req->resp->ptr + req->resp->used, v[i].iov_base, v[i].iov_len);
+            req->resp->used += v[i].iov_len;
+        }
+    }
+}
+
+/* complete a request with the given response and flush */
+static void http_req_respond(http_req_t* req, const struct iovec* v, int n) {
+    http_req_set_response(req, v, n);
+    http_conn_flush(req->conn);
+}
+
+/* error response, the connection is closed once it has been written */
+static void http_req_set_error(http_req_t* req, int status) {
+    http_response_t resp;
+
+    req->flags = req->flags & ~HTTP_REQ_KEEPALIVE;
+
+    http_req_response_init(req, &resp, status);
+    http_response_text_body(&resp, status);
+    http_req_set_response(req, resp.v, resp.n);
+}
+
+static void http_req_respond_error(http_req_t* req, int status) {
+    http_req_set_error(req, status);
+    http_conn_flush(req->conn);
+}
+
+/* 404 with a body, flushed by the caller */
+static void http_req_set_not_found(http_req_t* req) {
+    http_response_t resp;
+
+    http_req_response_init(req, &resp, HTTP_STATUS_NOT_FOUND);
+    http_response_text_body(&resp, HTTP_STATUS_NOT_FOUND);
+    http_req_set_response(req, resp.v, resp.n);
+}
+
+static void http_req_respond_not_found(http_req_t* req) {
+    http_req_set_not_found(req);
+    http_conn_flush(req->conn);
+}
+
+/* whether the client already has the value tagged etag */
+static int http_req_etag_match(http_req_t* req, uint64_t etag) {
+    int i;
+
+    if (req->flags & HTTP_REQ_ETAG_ANY) return 1;
+    for (i = 0; i < req->netags; i++) {
+        if (req->etags[i] == etag) return 1;
+    }
+    return 0;
+}
+
+/* 304 with the entity tag and no body, flushed by the caller */
+static void http_req_set_not_modified(http_req_t* req, uint64_t etag) {
+    http_response_t resp;
+
+    http_req_response_init(req, &resp, HTTP_STATUS_NOT_MODIFIED);
+    http_response_etag(&resp, etag);
+    http_response_append(&resp, "\r\n", 2);
+    http_req_set_response(req, resp.v, resp.n);
+}
+
+/* a redis reply for req arrived, false when nothing is left to respond */
+static int http_req_replied(http_req_t* req, redisReply* reply) {
+    http_conn_t* conn = req->conn;
+    conn->waiting--;
+
+    /*
+     * redis is making progress, give the others the full timeout again. The
+     * header timeout stays while an upload body is still coming in.
+     */
+    if (conn->waiting && !(conn->upload && conn->upload->state < REDIS_UPLOAD_COMMIT)) {
+        http_conn_timer_set(conn, HTTP_TIMER_REDIS, redis_timeout_ms);
+    }
+
+    if (conn->flags & HTTP_CONN_ERR) {
+        http_conn_close(conn);
+        return 0;
+    }
+
+    if (reply == NULL) {
+        /* redis connection has gone away */
+        http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+        return 0;
+    }
+    return 1;
+}
+
+/* answer a GET from its redis reply, NULL when the connection went away */
+static void http_req_respond_reply(http_req_t* req, redisReply* reply, const uint64_t* etag) {
+    if (!http_req_replied(req, reply)) return;
+
+    /* WRONGTYPE and other errors are no value to send */
+    if (REDIS_REPLY_STRING != reply->type && REDIS_REPLY_NIL != reply->type) {
+        fprintf(stderr, "unexpected reply type %d\n", reply->type);
+        http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+        return;
+    }
+
+    http_response_t resp;
+
+    if (0 == reply->len) {
+        http_req_respond_not_found(req);
+        return;
+    }
+
+    if (etag && http_req_etag_match(req, *etag)) {
+        http_req_set_not_modified(req, *etag);
+        http_conn_flush(req->conn);
+        return;
+    }
+
+    http_req_response_init(req, &resp, HTTP_STATUS_OK);
+    if (etag) http_response_etag(&resp, *etag);
+    http_response_content_length(&resp, reply->len);
+    http_response_append(&resp, reply->str, reply->len);
+    http_req_respond(req, resp.v, resp.n);
+}
+
+static void cache_init(cache_t* cache) {
+    cache->size  = CACHE_SLOTS_INITIAL;
+    cache->slots = calloc(cache->size, sizeof(cache_slot_t));
+    assert(cache->slots);
+    cache->count = 0;
+    cache->bytes = 0;
+    ngx_queue_init(&cache->lru);
+}
+
+static void cache_remove(cache_t* cache, cache_entry_t* e) {
+    size_t mask = cache->size - 1;
+    size_t i = e->hash & mask;
+    size_t j, k;
+
+    while (cache->slots[i].entry != e) i = (i + 1) & mask;
+
+    /* backward shift deletion, no tombstones */
+    for (j = i;;) {
+        j = (j + 1) & mask;
+        if (NULL == cache->slots[j].entry) break;
+
+        /* entries whose home slot lies in (i, j] stay put */
+        k = cache->slots[j].hash & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+
+        cache->slots[i] = cache->slots[j];
+        i = j;
+    }
+    cache->slots[i].entry = NULL;
+
+    ngx_queue_remove(&e->lru);
+    cache->count--;
+    cache->bytes -= sizeof(cache_entry_t) + e->key_len + e->data_len;
+    free(e);
+}
+
+static void cache_clear(cache_t* cache) {
+    while (!ngx_queue_empty(&cache->lru)) {
+        cache_remove(cache, ngx_queue_data(ngx_queue_last(&cache->lru), cache_entry_t, lru));
+    }
+}
+
+static void cache_free(cache_t* cache) {
+    cache_clear(cache);
+    free(cache->slots);
+}
+
+static cache_entry_t* cache_find(cache_t* cache, const char* key, size_t key_len, unsigned int hash) {
+    size_t mask = cache->size - 1;
+    size_t i = hash & mask;
+
+    for (; cache->slots[i].entry; i = (i + 1) & mask) {
+        cache_entry_t* e = cache->slots[i].entry;
+        if (cache->slots[i].hash == hash && e->key_len == key_len &&
+                0 == memcmp(e->data, key, key_len)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* fresh entry for key or NULL, marks it most recently used */
+static cache_entry_t* cache_get(http_server_t* server, const char* key, size_t key_len, unsigned int hash) {
+    cache_t* cache = &server->cache;
+    if (0 == cache->count) return NULL;
+
+    cache_entry_t* e = cache_find(cache, key, key_len, hash);
+    if (NULL == e) return NULL;
+
+    if (e->expires && e->expires <= ev_now(server->loop)) {
+        cache_remove(cache, e);
+        return NULL;
+    }
+
+    ngx_queue_remove(&e->lru);
+    ngx_queue_insert_head(&cache->lru, &e->lru);
+    return e;
+}
+
+static void cache_grow(cache_t* cache) {
+    size_t size = cache->size * 2;
+    cache_slot_t* slots = calloc(size, sizeof(cache_slot_t));
+    assert(slots);
+
+    size_t i, j;
+    for (i = 0; i < cache->size; i++) {
+        if (NULL == cache->slots[i].entry) continue;
+        for (j = cache->slots[i].hash & (size - 1); slots[j].entry; j = (j + 1) & (size - 1));
+        slots[j] = cache->slots[i];
+    }
+
+    free(cache->slots);
+    cache->slots = slots;
+    cache->size  = size;
+}
+
+/* remember a GET reply for key, only values and nil are cached */
+static void cache_put(http_server_t* server, const char* key, size_t key_len, unsigned int hash,
+        redisReply* reply, const uint64_t* etag) {
+    cache_t* cache = &server->cache;
+
+    if (REDIS_REPLY_STRING != reply->type && REDIS_REPLY_NIL != reply->type) return;
+
+    char hdr[HTTP_ETAG_LEN + sizeof(((http_response_t*)0)->content_length)];
+    size_t data_len = 0;
+    if (reply->len) {
+        if (etag) {
+            http_response_format_etag(hdr, *etag);
+            data_len = HTTP_ETAG_LEN;
+        }
+        data_len += http_response_format_content_length(hdr + data_len, reply->len);
+        data_len += reply->len;
+    }
+
+    size_t bytes = sizeof(cache_entry_t) + key_len + data_len;
+    /* large values would push out everything else */
+    if (bytes > cache_size / 4) return;
+
+    cache_entry_t* e = cache_find(cache, key, key_len, hash);
+    if (e) cache_remove(cache, e);
+
+    while (cache->bytes + bytes > cache_size) {
+        cache_remove(cache, ngx_queue_data(ngx_queue_last(&cache->lru), cache_entry_t, lru));
+    }
+
+    if ((cache->count + 1) * 2 > cache->size) {
+        cache_grow(cache);
+    }
+
+    e = malloc(bytes);
+    assert(e);
+    e->hash     = hash;
+    e->found    = reply->len ? 1 : 0;
+    e->etag     = etag ? *etag : 0;
+    e->expires  = cache_ttl_ms ? ev_now(server->loop) + cache_ttl_ms / 1000. : 0;
+    e->key_len  = key_len;
+    e->data_len = data_len;
+    memcpy(e->data, key, key_len);
+    if (reply->len) {
+        size_t hdr_len = data_len - reply->len;
+        memcpy(e->data + key_len, hdr, hdr_len);
+        memcpy(e->data + key_len + hdr_len, reply->str, reply->len);
+    }
+
+    size_t i, mask = cache->size - 1;
+    for (i = hash & mask; cache->slots[i].entry; i = (i + 1) & mask);
+    cache->slots[i].hash  = hash;
+    cache->slots[i].entry = e;
+
+    ngx_queue_insert_head(&cache->lru, &e->lru);
+    cache->count++;
+    cache->bytes += bytes;
+}
+
+/* answer req from a cache entry, flushed by the caller */
+static void http_req_respond_cached(http_req_t* req, cache_entry_t* e) {
+    http_response_t resp;
+
+    if (!e->found) {
+        http_req_set_not_found(req);
+        return;
+    }
+
+    /* the ETag line comes first in data */
+    if (http_etag && http_req_etag_match(req, e->etag)) {
+        http_req_set_not_modified(req, e->etag);
+        return;
+    }
+
+    /* ETag, Content-Length and value are stored preformatted */
+    http_req_response_init(req, &resp, HTTP_STATUS_OK);
+    http_response_append(&resp, e->data + e->key_len, e->data_len);
+    http_req_set_response(req, resp.v, resp.n);
+}
+
+static unsigned int redis_key_hash(const char* key, size_t len) {
+    /* FNV-1a */
+    unsigned int h = 2166136261U;
+    while (len--) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static redis_flight_t* redis_flight_find(http_server_t* server, const char* key, size_t len, unsigned int hash) {
+    redis_flight_t* f = server->flights[hash & (server->flights_size - 1)];
+    for (; f; f = f->next) {
+        if (f->hash == hash && f->key_len == len && 0 == memcmp(f->key, key, len)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static void redis_flight_add_req(redis_flight_t* f, http_req_t* req) {
+    if (f->nreqs == f->reqs_size) {
+        f->reqs_size *= 2;
+        f->reqs = realloc(f->reqs, sizeof(http_req_t*) * f->reqs_size);
+        assert(f->reqs);
+    }
+    f->reqs[f->nreqs++] = req;
+    req->flight = f;
+}
+
+static void redis_flight_remove_req(redis_flight_t* f, http_req_t* req) {
+    int i;
+    for (i = 0; i < f->nreqs; i++) {
+        if (f->reqs[i] == req) {
+            f->reqs[i] = f->reqs[--f->nreqs];
+            break;
+        }
+    }
+    req->flight = NULL;
+}
+
+static redis_flight_t* redis_flight_new(http_server_t* server, const char* key, size_t len, unsigned int hash) {
+    size_t i;
+
+    if (server->nflights >= server->flights_size) {
+        size_t size = server->flights_size * 2;
+        redis_flight_t** flights = calloc(size, sizeof(redis_flight_t*));
+        assert(flights);
+        for (i = 0; i < server->flights_size; i++) {
+            redis_flight_t* f = server->flights[i];
+            while (f) {
+                redis_flight_t* next = f->next;
+                f->next = flights[f->hash & (size - 1)];
+                flights[f->hash & (size - 1)] = f;
+                f = next;
+            }
+        }
+        free(server->flights);
+        server->flights = flights;
+        server->flights_size = size;
+    }
+
+    redis_flight_t* f = malloc(sizeof(redis_flight_t) + len);
+    assert(f);
+    f->hash      = hash;
+    f->nreqs     = 0;
+    f->reqs_size = 4;
+    f->reqs      = malloc(sizeof(http_req_t*) * f->reqs_size);
+    assert(f->reqs);
+    f->cache     = 0;
+    f->key_len   = len;
+    memcpy(f->key, key, len);
+
+    redis_flight_t** head = &server->flights[hash & (server->flights_size - 1)];
+    f->next = *head;
+    *head = f;
+    server->nflights++;
+
+    return f;
+}
+
+/* take the flight out of the table and answer all of its requests */
+static void redis_flight_respond(http_server_t* server, redis_flight_t* f, redisReply* reply) {
+    redis_flight_t** p = &server->flights[f->hash & (server->flights_size - 1)];
+    while (*p != f) p = &(*p)->next;
+    *p = f->next;
+    server->nflights--;
+
+    /* hashed once for every request and the cache */
+    uint64_t etag = 0;
+    int tagged = http_etag && reply && REDIS_REPLY_STRING == reply->type && reply->len;
+    if (tagged) {
+        etag = http_etag_hash(reply->str, reply->len);
+    }
+
+    if (reply && f->cache && f->generation == server->cache_generation) {
+        cache_put(server, f->key, f->key_len, f->hash, reply, tagged ? &etag : NULL);
+    }
+
+    /* the next request for a large value is streamed */
+    if (reply && redis_stream_threshold && REDIS_REPLY_STRING == reply->type &&
+            (size_t)reply->len >= redis_stream_threshold) {
+        redis_stream_hint(server, f->key, f->key_len, f->hash, 1);
+    }
+
+    int i;
+    for (i = 0; i < f->nreqs; i++) {
+        f->reqs[i]->flight = NULL;
+    }
+    for (i = 0; i < f->nreqs; i++) {
+        http_req_respond_reply(f->reqs[i], reply, tagged ? &etag : NULL);
+    }
+
+    free(f->reqs);
+    free(f);
+}
+
+/* the GET for f went out on rc */
+static void redis_flight_sent(redis_conn_t* rc, redis_flight_t* f) {
+    /* with --cache-tracking only replies redis will send invalidations for */
+    f->cache = cache_size && (!cache_tracking || rc->tracking);
+    f->generation = rc->server->cache_generation;
+}
+
+/* drop every cached response, replies still in flight are not cached either */
+static void cache_flush(http_server_t* server) {
+    cache_clear(&server->cache);
+    server->cache_generation++;
+}
+
+static void redis_data_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    redis_flight_t* f = (redis_flight_t*)privdata;
+
+    rc->inflight--;
+
+    if (f == NULL) {
+        fprintf(stderr, "invalid privdata\n");
+        return;
+    }
+
+    redis_flight_respond(rc->server, f, (redisReply*)r);
+}
+
+static void redis_batch_free(redis_batch_t* batch) {
+    if (batch->keys) sdsfree(batch->keys);
+    free(batch->flights);
+    free(batch->argvlen);
+    free(batch);
+}
+
+/* fan the MGET array reply back out to every request of the batch */
+static void redis_mget_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redisReply* reply = r;
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    redis_batch_t* batch = (redis_batch_t*)privdata;
+    int i;
+
+    rc->inflight--;
+
+    if (reply && (REDIS_REPLY_ARRAY != reply->type || reply->elements != (size_t)batch->n)) {
+        fprintf(stderr, "unexpected MGET reply type %d\n", reply->type);
+        reply = NULL;
+    }
+
+    for (i = 0; i < batch->n; i++) {
+        redis_flight_respond(rc->server, batch->flights[i], reply ? reply->element[i] : NULL);
+    }
+
+    redis_batch_free(batch);
+}
+
+static void redis_batch_flush(http_server_t* server) {
+    redis_batch_t* batch = server->batch;
+    int i;
+
+    server->batch = NULL;
+    ev_prepare_stop(server->loop, &server->batch_prepare);
+    ev_timer_stop(server->loop, &server->batch_timer);
+
+    if (NULL == batch) return;
+
+    redis_conn_t* rc = redis_pick(server);
+    int status = REDIS_ERR;
+
+    if (rc) {
+        const char* argv[batch->n + 1];
+        const char* key = batch->keys;
+
+        argv[0] = "MGET";
+        for (i = 1; i <= batch->n; i++) {
+            argv[i] = key;
+            key += batch->argvlen[i];
+        }
+
+        status = redisAsyncCommandArgv(rc->context, redis_mget_cb, batch,
+            batch->n + 1, argv, batch->argvlen);
+    }
+
+    sdsfree(batch->keys);
+    batch->keys = NULL;
+
+    if (REDIS_OK == status) {
+        for (i = 0; i < batch->n; i++) {
+            redis_flight_sent(rc, batch->flights[i]);
+        }
+        rc->inflight++;
+        return;
+    }
+
+    /* redis went away while the batch was collected */
+    for (i = 0; i < batch->n; i++) {
+        redis_flight_respond(server, batch->flights[i], NULL);
+    }
+    redis_batch_free(batch);
+}
+
+static void redis_batch_prepare_cb(EV_P_ ev_prepare* w, int revents) {
+    http_server_t* server = (http_server_t*)
+        (((char*)w) - offsetof(http_server_t, batch_prepare));
+    redis_batch_flush(server);
+}
+
+static void redis_batch_timer_cb(EV_P_ ev_timer* w, int revents) {
+    http_server_t* server = (http_server_t*)
+        (((char*)w) - offsetof(http_server_t, batch_timer));
+    redis_batch_flush(server);
+}
+
+static void redis_tracking_on_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redisReply* reply = r;
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+
+    if (reply && REDIS_REPLY_ERROR == reply->type) {
+        fprintf(stderr, "CLIENT TRACKING failed: %s\n", reply->str);
+        /* anything sent since was marked cacheable */
+        rc->tracking = 0;
+        cache_flush(rc->server);
+    }
+}
+
+/* have redis send invalidations for keys read on rc to the tracking connection */
+static void redis_tracking_enable(redis_conn_t* rc) {
+    http_server_t* server = rc->server;
+
+    if (!rc->connected || !server->tracking.tracking) return;
+
+    if (REDIS_OK == redisAsyncCommand(rc->context, redis_tracking_on_cb, NULL,
+            "CLIENT TRACKING on REDIRECT %lld", server->tracking_id)) {
+        rc->tracking = 1;
+    }
+}
+
+static void redis_invalidate_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redisReply* reply = r;
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    http_server_t* server = rc->server;
+    size_t i;
+
+    if (NULL == reply || REDIS_REPLY_ARRAY != reply->type || reply->elements < 3) return;
+
+    const char* kind = reply->element[0]->str;
+
+    if (0 == strcmp(kind, "subscribe")) {
+        rc->tracking = 1;
+        for (i = 0; i < (size_t)server->nredis; i++) {
+            redis_tracking_enable(&server->redis[i]);
+        }
+        return;
+    }
+
+    if (0 != strcmp(kind, "message")) return;
+
+    redisReply* keys = reply->element[2];
+    if (REDIS_REPLY_ARRAY != keys->type) {
+        /* FLUSHALL / FLUSHDB */
+        cache_flush(server);
+        return;
+    }
+
+    for (i = 0; i < keys->elements; i++) {
+        const char* key = keys->element[i]->str;
+        size_t key_len  = keys->element[i]->len;
+        unsigned int hash = redis_key_hash(key, key_len);
+
+        cache_entry_t* e = cache_find(&server->cache, key, key_len, hash);
+        if (e) cache_remove(&server->cache, e);
+
+        /* the reply may still carry the old value */
+        redis_flight_t* f = redis_flight_find(server, key, key_len, hash);
+        if (f) f->cache = 0;
+    }
+}
+
+static void redis_tracking_id_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redisReply* reply = r;
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+
+    if (NULL == reply) return;
+    if (REDIS_REPLY_INTEGER != reply->type) {
+        fprintf(stderr, "CLIENT ID failed, caching disabled\n");
+        return;
+    }
+
+    rc->server->tracking_id = reply->integer;
+    redisAsyncCommand(c, redis_invalidate_cb, NULL, "SUBSCRIBE __redis__:invalidate");
+}
+
+static void redis_tracking_connected(redis_conn_t* rc) {
+    if (rc == &rc->server->tracking) {
+        redisAsyncCommand(rc->context, redis_tracking_id_cb, NULL, "CLIENT ID");
+    }
+    else {
+        redis_tracking_enable(rc);
+    }
+}
+
+/*
+ * Keys read on a dropped connection are no longer tracked, and nothing is
+ * while the tracking connection is down, so the cache cannot be trusted.
+ */
+static void redis_tracking_lost(redis_conn_t* rc) {
+    http_server_t* server = rc->server;
+    int i;
+
+    rc->tracking = 0;
+
+    if (rc == &server->tracking) {
+        /* redirected to a client id that is gone, enabled again on reconnect */
+        for (i = 0; i < server->nredis; i++) {
+            server->redis[i].tracking = 0;
+        }
+    }
+
+    cache_flush(server);
+}
+
+static void redis_stream_hint(http_server_t* server, const char* key, size_t key_len, unsigned int hash, int large) {
+    redis_stream_hint_t* h = &server->stream_hints[hash & (REDIS_STREAM_HINTS - 1)];
+
+    if (large) {
+        if (h->key) sdsfree(h->key);
+        h->hash = hash;
+        h->key  = sdsnewlen(key, key_len);
+    }
+    else if (h->key && h->hash == hash) {
+        sdsfree(h->key);
+        h->key = NULL;
+    }
+}
+
+static int redis_stream_hinted(http_server_t* server, const char* key, size_t key_len, unsigned int hash) {
+    redis_stream_hint_t* h = &server->stream_hints[hash & (REDIS_STREAM_HINTS - 1)];
+    return h->key && h->hash == hash && sdslen(h->key) == key_len &&
+        0 == memcmp(h->key, key, key_len);
+}
+
+static void redis_stream_read_cb(EV_P_ ev_io* w, int revents);
+static void redis_stream_write_cb(EV_P_ ev_io* w, int revents);
+
+/* a plain non-blocking redis connection, still connecting */
+static redisContext* redis_connect_plain(const char* what) {
+    redisContext* c;
+    if (redis_socket) {
+        c = redisConnectUnixNonBlock(redis_socket);
+    }
+    else {
+        c = redisConnectNonBlock(redis_address, redis_port);
+    }
+    if (NULL == c) return NULL;
+    if (c->err) {
+        fprintf(stderr, "Failed to connect redis server for %s: %s\n", what, c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* whether a non-blocking connect finished without error */
+static int redis_connect_done(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        fprintf(stderr, "redis connect error: %s\n", strerror(err ? err : errno));
+        return 0;
+    }
+    return 1;
+}
+
+static redis_stream_t* redis_stream_new(http_server_t* server) {
+    redisContext* c = redis_connect_plain("streaming");
+    if (NULL == c) return NULL;
+
+    redis_stream_t* st = malloc(sizeof(redis_stream_t));
+    assert(st);
+    st->context   = c;
+    st->connected = 0;
+    st->cmd       = NULL;
+    st->rbuf      = buffer_init();
+    st->req       = NULL;
+    st->server    = server;
+    ngx_queue_init(&st->queue);
+
+    st->pipe[0] = st->pipe[1] = -1;
+#ifdef SPLICE_F_MOVE
+    if (-1 == pipe2(st->pipe, O_NONBLOCK | O_CLOEXEC)) {
+        st->pipe[0] = st->pipe[1] = -1;
+    }
+#endif
+
+    ev_io_init(&st->ev_read, redis_stream_read_cb, c->fd, EV_READ);
+    ev_io_init(&st->ev_write, redis_stream_write_cb, c->fd, EV_WRITE);
+
+    server->nstreams++;
+    return st;
+}
+
+static void redis_stream_free(redis_stream_t* st) {
+    http_server_t* server = st->server;
+
+    ev_io_stop(server->loop, &st->ev_read);
+    ev_io_stop(server->loop, &st->ev_write);
+    ngx_queue_remove(&st->queue);
+
+    redisFree(st->context);
+    if (-1 != st->pipe[0]) {
+        close(st->pipe[0]);
+        close(st->pipe[1]);
+    }
+    free(st->cmd);
+    buffer_free(st->rbuf);
+    free(st);
+
+    server->nstreams--;
+}
+
+/*
+ * Stream GET key for req when the value is expected to be large and req can
+ * write to the client right away: it is the head request and nothing is
+ * queued in front of it.
+ */
+static int redis_stream_get(http_server_t* server, http_req_t* req, const char* key, size_t key_len, unsigned int hash) {
+    http_conn_t* conn = req->conn;
+    redis_stream_t* st;
+
+    if (!redis_stream_hinted(server, key, key_len, hash)) return REDIS_ERR;
+    if (conn->stream || conn->output_size ||
+            ngx_queue_head(&conn->requests) != &req->queue) {
+        return REDIS_ERR;
+    }
+
+    if (!ngx_queue_empty(&server->streams_idle)) {
+        st = ngx_queue_data(ngx_queue_head(&server->streams_idle), redis_stream_t, queue);
+        ngx_queue_remove(&st->queue);
+        ngx_queue_init(&st->queue);
+        ev_io_stop(server->loop, &st->ev_read);
+    }
+    else if (server->nstreams < REDIS_STREAM_MAX) {
+        st = redis_stream_new(server);
+        if (NULL == st) return REDIS_ERR;
+    }
+    else {
+        return REDIS_ERR;
+    }
+
+    int len = redisFormatCommand(&st->cmd, "GET %b", key, key_len);
+    assert(len > 0);
+    st->cmd_len   = len;
+    st->cmd_off   = 0;
+    st->req       = req;
+    st->hash      = hash;
+    st->body_len  = -1;
+    st->remaining = 0;
+    st->streaming = 0;
+    st->rbuf->used = 0;
+
+    conn->stream = st;
+    ev_io_start(server->loop, &st->ev_write);
+    return REDIS_OK;
+}
+
+/*
+ * Back to the idle list, watching for redis closing the connection meanwhile.
+ * rbuf keeps its contents until the next reply is read.
+ */
+static void redis_stream_release(redis_stream_t* st) {
+    st->req->conn->stream = NULL;
+    st->req = NULL;
+    st->rbuf->used = 0;
+
+    ngx_queue_insert_head(&st->server->streams_idle, &st->queue);
+    ev_io_start(st->server->loop, &st->ev_read);
+}
+
+/* the client went away, the rest of the reply cannot be skipped cheaply */
+static void redis_stream_abort(redis_stream_t* st) {
+    http_conn_t* conn = st->req->conn;
+
+    conn->stream = NULL;
+    conn->waiting--;
+    redis_stream_free(st);
+}
+
+/* redis went away */
+static void redis_stream_fail(redis_stream_t* st) {
+    http_req_t* req = st->req;
+    http_conn_t* conn = req->conn;
+    int streaming = st->streaming;
+
+    conn->stream = NULL;
+    redis_stream_free(st);
+
+    if (streaming) {
+        /* headers promised more than can be sent */
+        conn->waiting--;
+        conn->flags = conn->flags | HTTP_CONN_ERR;
+        http_conn_close(conn);
+        return;
+    }
+    http_req_respond_reply(req, NULL, NULL);
+}
+
+static void redis_stream_resume(redis_stream_t* st) {
+    if (NULL == st->cmd && st->req->conn->output_size < http_write_hwm) {
+        ev_io_start(st->server->loop, &st->ev_read);
+    }
+}
+
+static void redis_stream_write_cb(EV_P_ ev_io* w, int revents) {
+    redis_stream_t* st = (redis_stream_t*)
+        (((char*)w) - offsetof(redis_stream_t, ev_write));
+
+    if (!st->connected) {
+        if (!redis_connect_done(w->fd)) {
+            redis_stream_fail(st);
+            return;
+        }
+        st->connected = 1;
+    }
+
+    ssize_t r = write(w->fd, st->cmd + st->cmd_off, st->cmd_len - st->cmd_off);
+    if (-1 == r) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) return;
+        redis_stream_fail(st);
+        return;
+    }
+
+    st->cmd_off += r;
+    if (st->cmd_off < st->cmd_len) return;
+
+    free(st->cmd);
+    st->cmd = NULL;
+    ev_io_stop(EV_A_ w);
+    ev_io_start(EV_A_ &st->ev_read);
+}
+
+/* value done: the request is answered, the connection can take the next GET */
+static void redis_stream_finish(redis_stream_t* st) {
+    http_req_t* req = st->req;
+    http_conn_t* conn = req->conn;
+
+    redis_stream_release(st);
+
+    req->flags = req->flags | HTTP_REQ_DONE;
+    conn->waiting--;
+    http_conn_flush(conn);
+}
+
+/* value bytes from rbuf, then straight from the socket */
+static void redis_stream_forward(redis_stream_t* st) {
+    http_conn_t* conn = st->req->conn;
+    buffer* rbuf = st->rbuf;
+    int i;
+
+    if (rbuf->used) {
+        size_t n = rbuf->used < (size_t)st->remaining ? rbuf->used : (size_t)st->remaining;
+        size_t body = st->remaining > 2 ? st->remaining - 2 : 0;
+        if (body > n) body = n;
+
+        if (body) {
+            struct iovec v = { rbuf->ptr, body };
+            http_conn_write(conn, &v, 1);
+        }
+
+        memmove(rbuf->ptr, rbuf->ptr + n, rbuf->used - n);
+        rbuf->used   -= n;
+        st->remaining -= n;
+    }
+
+#ifdef SPLICE_F_MOVE
+    for (i = 0; i < REDIS_STREAM_BUDGET && -1 != st->pipe[0] &&
+            st->remaining > 2 && 0 == conn->output_size &&
+            !(conn->flags & HTTP_CONN_ERR); i++) {
+        size_t want = st->remaining - 2;
+        if (want > REDIS_STREAM_CHUNK) want = REDIS_STREAM_CHUNK;
+
+        ssize_t n = splice(st->context->fd, NULL, st->pipe[1], NULL, want,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (0 == n) {
+            redis_stream_fail(st);
+            return;
+        }
+        if (-1 == n) {
+            if (EAGAIN == errno) break;
+            if (EINVAL != errno) {
+                redis_stream_fail(st);
+                return;
+            }
+            /* not spliceable, read and write instead */
+            close(st->pipe[0]);
+            close(st->pipe[1]);
+            st->pipe[0] = st->pipe[1] = -1;
+            break;
+        }
+        st->remaining -= n;
+
+        ssize_t m = splice(st->pipe[0], NULL, conn->fd, NULL, n,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (-1 == m) {
+            if (EAGAIN != errno) {
+                conn->flags = conn->flags | HTTP_CONN_ERR;
+                break;
+            }
+            m = 0;
+        }
+
+        if (m < n) {
+            /* the client is full, queue what is left in the pipe */
+            http_chunk_t* chunk = malloc(sizeof(http_chunk_t) + (n - m));
+            assert(chunk);
+            chunk->ptr = (char*)(chunk + 1);
+            chunk->len = n - m;
+            chunk->buf = NULL;
+            ssize_t r = read(st->pipe[0], chunk->ptr, n - m);
+            assert(r == n - m);
+            http_conn_queue_chunk(conn, chunk);
+        }
+    }
+#endif
+
+    if (conn->flags & HTTP_CONN_ERR) {
+        http_conn_close(conn);
+        return;
+    }
+
+    if (0 == st->remaining) {
+        redis_stream_finish(st);
+        return;
+    }
+
+    /* resumed by http_conn_flush once the client caught up */
+    if (conn->output_size >= http_write_hwm) {
+        ev_io_stop(st->server->loop, &st->ev_read);
+    }
+}
+
+/* the reply header, and the whole value unless it is large */
+static void redis_stream_reply(redis_stream_t* st) {
+    http_req_t* req = st->req;
+    buffer* rbuf = st->rbuf;
+
+    if (st->body_len < 0) {
+        char* eol = memchr(rbuf->ptr, '\n', rbuf->used);
+        if (NULL == eol) return;
+
+        size_t header_len = eol + 1 - rbuf->ptr;
+        if (header_len < 3 || '\r' != eol[-1]) {
+            redis_stream_fail(st);
+            return;
+        }
+
+        if (header_len != rbuf->used && '$' != rbuf->ptr[0]) {
+            redis_stream_fail(st);
+            return;
+        }
+
+        if ('-' == rbuf->ptr[0]) {
+            redisReply reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = REDIS_REPLY_ERROR;
+            reply.str  = rbuf->ptr + 1;
+            reply.len  = header_len - 3;
+
+            redis_stream_release(st);
+            http_req_respond_reply(req, &reply, NULL);
+            return;
+        }
+        if ('$' != rbuf->ptr[0]) {
+            redis_stream_fail(st);
+            return;
+        }
+
+        st->body_len = strtoll(rbuf->ptr + 1, NULL, 10);
+        memmove(rbuf->ptr, rbuf->ptr + header_len, rbuf->used - header_len);
+        rbuf->used -= header_len;
+
+        if (st->body_len < 0) {
+            if (rbuf->used) {
+                redis_stream_fail(st);
+                return;
+            }
+
+            redisReply reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = REDIS_REPLY_NIL;
+
+            redis_stream_release(st);
+            http_req_respond_reply(req, &reply, NULL);
+            return;
+        }
+
+        if ((size_t)st->body_len >= redis_stream_threshold) {
+            http_response_t resp;
+
+            http_req_response_init(req, &resp, HTTP_STATUS_OK);
+            http_response_content_length(&resp, st->body_len);
+            http_conn_write(req->conn, resp.v, resp.n);
+            st->streaming = 1;
+            st->remaining = st->body_len + 2;
+        }
+    }
+
+    if (st->streaming) {
+        redis_stream_forward(st);
+        return;
+    }
+
+    if (rbuf->used < (size_t)st->body_len + 2) return;
+    if (rbuf->used > (size_t)st->body_len + 2) {
+        redis_stream_fail(st);
+        return;
+    }
+
+    /* small after all */
+    redis_stream_hint(st->server, NULL, 0, st->hash, 0);
+
+    redisReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = REDIS_REPLY_STRING;
+    reply.str  = rbuf->ptr;
+    reply.len  = st->body_len;
+
+    uint64_t etag = 0;
+    if (http_etag && reply.len) {
+        etag = http_etag_hash(reply.str, reply.len);
+    }
+
+    redis_stream_release(st);
+    http_req_respond_reply(req, &reply, http_etag && reply.len ? &etag : NULL);
+}
+
+static void redis_stream_read_cb(EV_P_ ev_io* w, int revents) {
+    redis_stream_t* st = (redis_stream_t*)
+        (((char*)w) - offsetof(redis_stream_t, ev_read));
+    buffer* rbuf = st->rbuf;
+
+    if (NULL == st->req) {
+        /* idle: closed by redis, or garbage */
+        redis_stream_free(st);
+        return;
+    }
+
+    if (st->streaming && st->remaining > 2 && 0 == rbuf->used &&
+            -1 != st->pipe[0] && 0 == st->req->conn->output_size) {
+        redis_stream_forward(st);
+        return;
+    }
+
+    buffer_prepare_append(rbuf, REDIS_STREAM_CHUNK);
+    size_t want = REDIS_STREAM_CHUNK;
+    if (st->streaming && (size_t)st->remaining < want) want = st->remaining;
+
+    ssize_t r = read(w->fd, rbuf->ptr + rbuf->used, want);
+    if (0 == r || (-1 == r && EAGAIN != errno && EWOULDBLOCK != errno)) {
+        redis_stream_fail(st);
+        return;
+    }
+    if (-1 == r) return;
+
+    rbuf->used += r;
+    redis_stream_reply(st);
+}
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* 16 hex digits that differ for every call, for boundaries and temporary keys */
+static void http_server_unique(http_server_t* server, char* p) {
+    uint64_t h = http_etag_hash((const char*)&server->unique, sizeof(server->unique));
+    int i;
+
+    server->unique++;
+    for (i = 0; i < 16; i++) {
+        p[i] = HEX_DIGITS[(h >> (60 - 4 * i)) & 0xf];
+    }
+}
+
+static void redis_upload_read_cb(EV_P_ ev_io* w, int revents);
+static void redis_upload_write_cb(EV_P_ ev_io* w, int revents);
+
+static redis_upload_t* redis_upload_new(http_server_t* server) {
+    redisContext* c = redis_connect_plain("uploads");
+    if (NULL == c) return NULL;
+
+    redis_upload_t* u = malloc(sizeof(redis_upload_t));
+    assert(u);
+    u->context   = c;
+    u->connected = 0;
+    u->wbuf      = buffer_init();
+    u->woff      = 0;
+    u->rbuf      = buffer_init();
+    u->req       = NULL;
+    u->replies   = 0;
+    u->key = u->tmp = u->append = NULL;
+    u->server    = server;
+    ngx_queue_init(&u->queue);
+
+    ev_io_init(&u->ev_read, redis_upload_read_cb, c->fd, EV_READ);
+    ev_io_init(&u->ev_write, redis_upload_write_cb, c->fd, EV_WRITE);
+
+    server->nuploads++;
+    return u;
+}
+
+static void redis_upload_clear(redis_upload_t* u) {
+    if (u->key) sdsfree(u->key);
+    if (u->tmp) sdsfree(u->tmp);
+    if (u->append) sdsfree(u->append);
+    u->key = u->tmp = u->append = NULL;
+}
+
+static void redis_upload_free(redis_upload_t* u) {
+    http_server_t* server = u->server;
+
+    ev_io_stop(server->loop, &u->ev_read);
+    ev_io_stop(server->loop, &u->ev_write);
+    ngx_queue_remove(&u->queue);
+
+    redisFree(u->context);
+    buffer_free(u->wbuf);
+    buffer_free(u->rbuf);
+    redis_upload_clear(u);
+    free(u);
+
+    server->nuploads--;
+}
+
+/* back to the idle list, watching for redis closing the connection meanwhile */
+static void redis_upload_release(redis_upload_t* u) {
+    u->req = NULL;
+    u->wbuf->used = u->woff = 0;
+    u->rbuf->used = 0;
+    redis_upload_clear(u);
+
+    ngx_queue_insert_head(&u->server->uploads_idle, &u->queue);
+}
+
+/* queue bytes for redis, written right away while nothing is pending */
+static void redis_upload_send(redis_upload_t* u, const char* p, size_t len) {
+    buffer* wbuf = u->wbuf;
+
+    if (u->connected && wbuf->used == u->woff) {
+        /* errors show up again in redis_upload_write_cb */
+        ssize_t r = write(u->context->fd, p, len);
+        if (r > 0) {
+            p   += r;
+            len -= r;
+        }
+        if (0 == len) return;
+        wbuf->used = u->woff = 0;
+    }
+
+    buffer_prepare_append(wbuf, len);
+    memcpy(wbuf->ptr + wbuf->used, p, len);
+    wbuf->used += len;
+    ev_io_start(u->server->loop, &u->ev_write);
+}
+
+static void redis_upload_command(redis_upload_t* u, const char* fmt, ...) {
+    va_list ap;
+    char* cmd;
+
+    va_start(ap, fmt);
+    int len = redisvFormatCommand(&cmd, fmt, ap);
+    va_end(ap);
+    assert(len > 0);
+
+    redis_upload_send(u, cmd, len);
+    u->replies++;
+    free(cmd);
+}
+
+/* the value is stored, or not */
+static void http_req_respond_stored(http_req_t* req, redisReply* reply) {
+    if (!http_req_replied(req, reply)) return;
+
+    if (REDIS_REPLY_ERROR == reply->type) {
+        http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+        return;
+    }
+
+    http_response_t resp;
+
+    http_req_response_init(req, &resp, HTTP_STATUS_NO_CONTENT);
+    http_response_append(&resp, "\r\n", 2);
+    http_req_respond(req, resp.v, resp.n);
+}
+
+/* redis went away or could not be reached */
+static void redis_upload_fail(redis_upload_t* u) {
+    http_req_t* req = u->req;
+
+    if (req && u->state < REDIS_UPLOAD_COMMIT) {
+        /* the rest of the body is not read, nothing after it can be parsed */
+        req->conn->flags = req->conn->flags | HTTP_CONN_LAST;
+    }
+    if (req) {
+        req->conn->upload = NULL;
+    }
+    redis_upload_free(u);
+
+    if (req) {
+        req->upload = NULL;
+        http_req_respond_stored(req, NULL);
+    }
+}
+
+/*
+ * The client went away or sent a broken body. Closing the redis connection
+ * drops the unfinished command, a temporary key expires by itself.
+ */
+static void redis_upload_abort(redis_upload_t* u) {
+    http_conn_t* conn = u->req->conn;
+
+    conn->upload   = NULL;
+    u->req->upload = NULL;
+    conn->waiting--;
+    redis_upload_free(u);
+}
+
+/* every APPEND made it: move the value in place, or drop it */
+static void redis_upload_commit(redis_upload_t* u) {
+    u->state = REDIS_UPLOAD_DONE;
+
+    if (u->failed) {
+        redis_upload_command(u, "DEL %b", u->tmp, sdslen(u->tmp));
+        return;
+    }
+
+    /* RENAME keeps the expire time of tmp */
+    if (u->ttl) {
+        redis_upload_command(u, "EXPIRE %b %lld", u->tmp, sdslen(u->tmp), u->ttl);
+    }
+    else {
+        redis_upload_command(u, "PERSIST %b", u->tmp, sdslen(u->tmp));
+    }
+    redis_upload_command(u, "RENAME %b %b", u->tmp, sdslen(u->tmp), u->key, sdslen(u->key));
+}
+
+/* all replies are in */
+static void redis_upload_finish(redis_upload_t* u) {
+    http_server_t* server = u->server;
+    http_req_t* req = u->req;
+
+    redisReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = u->failed ? REDIS_REPLY_ERROR : REDIS_REPLY_STATUS;
+
+    /* the cached value is stale now */
+    if (!u->failed && cache_size) {
+        cache_entry_t* e = cache_find(&server->cache, u->key, sdslen(u->key),
+            redis_key_hash(u->key, sdslen(u->key)));
+        if (e) cache_remove(&server->cache, e);
+    }
+
+    /* idle, its read watcher would keep a stopped server's loop running */
+    if (server->closing) {
+        redis_upload_free(u);
+    }
+    else {
+        redis_upload_release(u);
+    }
+
+    if (req) {
+        req->upload = NULL;
+        req->conn->upload = NULL;
+        http_req_respond_stored(req, &reply);
+    }
+}
+
+static void redis_upload_write_cb(EV_P_ ev_io* w, int revents) {
+    redis_upload_t* u = (redis_upload_t*)
+        (((char*)w) - offsetof(redis_upload_t, ev_write));
+    buffer* wbuf = u->wbuf;
+
+    if (!u->connected) {
+        if (!redis_connect_done(w->fd)) {
+            redis_upload_fail(u);
+            return;
+        }
+        u->connected = 1;
+    }
+
+    int paused = wbuf->used - u->woff >= REDIS_UPLOAD_HWM;
+
+    ssize_t r = write(w->fd, wbuf->ptr + u->woff, wbuf->used - u->woff);
+    if (-1 == r) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) return;
+        redis_upload_fail(u);
+        return;
+    }
+
+    u->woff += r;
+    if (u->woff == wbuf->used) {
+        wbuf->used = u->woff = 0;
+        ev_io_stop(EV_A_ w);
+    }
+
+    /* the client was paused on a full backlog, may close its connection */
+    if (paused && u->req && u->req->conn->upload == u &&
+            wbuf->used - u->woff < REDIS_UPLOAD_HWM) {
+        http_conn_flush(u->req->conn);
+    }
+}
+
+static void redis_upload_read_cb(EV_P_ ev_io* w, int revents) {
+    redis_upload_t* u = (redis_upload_t*)
+        (((char*)w) - offsetof(redis_upload_t, ev_read));
+    buffer* rbuf = u->rbuf;
+
+    if (0 == u->replies) {
+        /* idle: closed by redis, or garbage */
+        redis_upload_fail(u);
+        return;
+    }
+
+    buffer_prepare_append(rbuf, 512);
+    ssize_t r = read(w->fd, rbuf->ptr + rbuf->used, rbuf->size - rbuf->used);
+    if (0 == r || (-1 == r && EAGAIN != errno && EWOULDBLOCK != errno)) {
+        redis_upload_fail(u);
+        return;
+    }
+    if (-1 == r) return;
+    rbuf->used += r;
+
+    /* every command sent here has a single line reply */
+    char* p   = rbuf->ptr;
+    char* end = rbuf->ptr + rbuf->used;
+    char* eol;
+    while (u->replies && (eol = memchr(p, '\n', end - p))) {
+        if ('-' == *p) {
+            fprintf(stderr, "upload of %s failed: %.*s\n", u->key, (int)(eol - p - 2), p + 1);
+            u->failed = 1;
+        }
+        u->replies--;
+        p = eol + 1;
+    }
+    if (0 == u->replies && p < end) {
+        redis_upload_fail(u);
+        return;
+    }
+    memmove(rbuf->ptr, p, end - p);
+    rbuf->used = end - p;
+
+    if (u->replies) return;
+
+    if (REDIS_UPLOAD_COMMIT == u->state) {
+        redis_upload_commit(u);
+    }
+    else if (REDIS_UPLOAD_DONE == u->state) {
+        redis_upload_finish(u);
+    }
+}
+
+/*
+ * Start sending the body of req to redis as the value of key, read by
+ * redis_upload_feed. Returns HTTP_STATUS_OK, or the error to answer.
+ */
+static int redis_upload_start(http_server_t* server, http_req_t* req, const char* key, size_t key_len,
+        long long body_len, long long ttl) {
+    redis_upload_t* u;
+
+    if (!ngx_queue_empty(&server->uploads_idle)) {
+        u = ngx_queue_data(ngx_queue_head(&server->uploads_idle), redis_upload_t, queue);
+        ngx_queue_remove(&u->queue);
+        ngx_queue_init(&u->queue);
+    }
+    else if (server->nuploads < REDIS_UPLOAD_MAX) {
+        u = redis_upload_new(server);
+        if (NULL == u) return HTTP_STATUS_BAD_GATEWAY;
+    }
+    else {
+        return HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+
+    u->req     = req;
+    u->failed  = 0;
+    u->ttl     = ttl;
+    u->key     = sdsnewlen(key, key_len);
+    u->replies = 0;
+
+    if (body_len >= 0) {
+        /* SET key, the value follows as it arrives, then EX */
+        u->state     = REDIS_UPLOAD_BODY;
+        u->remaining = body_len;
+        sds cmd = sdscatprintf(sdsempty(), "*%d\r\n$3\r\nSET\r\n$%zu\r\n", ttl ? 5 : 3, key_len);
+        cmd = sdscatlen(cmd, key, key_len);
+        cmd = sdscatprintf(cmd, "\r\n$%lld\r\n", body_len);
+        redis_upload_send(u, cmd, sdslen(cmd));
+        u->replies++;
+        sdsfree(cmd);
+    }
+    else {
+        char id[16];
+        http_server_unique(server, id);
+
+        u->state  = REDIS_UPLOAD_CHUNK_SIZE;
+        u->tmp    = sdscatlen(sdsnew("redis-http:upload:"), id, sizeof(id));
+        u->append = sdscatprintf(sdsempty(), "*3\r\n$6\r\nAPPEND\r\n$%zu\r\n%s\r\n$",
+            sdslen(u->tmp), u->tmp);
+        redis_upload_command(u, "SET %b %b EX %d", u->tmp, sdslen(u->tmp), "", (size_t)0,
+            REDIS_UPLOAD_TMP_TTL);
+    }
+
+    req->upload = u;
+    req->conn->upload = u;
+    ev_io_start(server->loop, &u->ev_read);
+    return HTTP_STATUS_OK;
+}
+
+/* the whole body went out, the rest of rbuf waits for the value to be stored */
+static void redis_upload_body_done(redis_upload_t* u) {
+    if (REDIS_UPLOAD_BODY == u->state) {
+        redis_upload_send(u, "\r\n", 2);
+        if (u->ttl) {
+            char ttl[20];
+            size_t len = http_u64toa(ttl, u->ttl);
+            sds ex = sdscatprintf(sdsempty(), "$2\r\nEX\r\n$%zu\r\n", len);
+            ex = sdscatlen(ex, ttl, len);
+            ex = sdscatlen(ex, "\r\n", 2);
+            redis_upload_send(u, ex, sdslen(ex));
+            sdsfree(ex);
+        }
+        u->state = REDIS_UPLOAD_DONE;
+        return;
+    }
+
+    u->state = REDIS_UPLOAD_COMMIT;
+    if (0 == u->replies) {
+        redis_upload_commit(u);
+    }
+}
+
+/* broken chunked framing, nothing after it can be parsed */
+static void redis_upload_reject(redis_upload_t* u) {
+    http_req_t* req = u->req;
+
+    req->conn->flags = req->conn->flags | HTTP_CONN_LAST;
+    redis_upload_abort(u);
+    http_req_respond_error(req, HTTP_STATUS_BAD_REQUEST);
+}
+
+/*
+ * Take body bytes of the upload of conn from p, as many as redis keeps up
+ * with. Returns how many were consumed, or -1 when the chunked framing was
+ * broken and the request has been answered.
+ */
+static ssize_t redis_upload_feed(http_conn_t* conn, const char* p, size_t len) {
+    redis_upload_t* u = conn->upload;
+    const char* start = p;
+    const char* end   = p + len;
+
+    while (conn->upload && http_conn_readable(conn)) {
+        int state = u->state;
+
+        if (REDIS_UPLOAD_BODY == state || REDIS_UPLOAD_CHUNK_DATA == state) {
+            size_t n = (size_t)(end - p) < (unsigned long long)u->remaining
+                ? (size_t)(end - p) : (size_t)u->remaining;
+            if (n) {
+                redis_upload_send(u, p, n);
+                p += n;
+                u->remaining -= n;
+            }
+            if (u->remaining) break;
+
+            if (REDIS_UPLOAD_BODY == state) {
+                redis_upload_body_done(u);
+            }
+            else {
+                redis_upload_send(u, "\r\n", 2);
+                u->state = REDIS_UPLOAD_CHUNK_CRLF;
+            }
+            continue;
+        }
+
+        if (REDIS_UPLOAD_CHUNK_CRLF == state) {
+            if (end - p < 2) break;
+            if ('\r' != p[0] || '\n' != p[1]) {
+                redis_upload_reject(u);
+                return -1;
+            }
+            p += 2;
+            u->state = REDIS_UPLOAD_CHUNK_SIZE;
+            continue;
+        }
+
+        /* size line or trailer line */
+        const char* eol = memchr(p, '\n', end - p);
+        if (NULL == eol) {
+            if (end - p > 1024) {
+                redis_upload_reject(u);
+                return -1;
+            }
+            break;
+        }
+        const char* line = p;
+        size_t line_len  = eol - p;
+        if (line_len && '\r' == line[line_len - 1]) line_len--;
+        p = eol + 1;
+
+        if (REDIS_UPLOAD_TRAILER == state) {
+            if (0 == line_len) redis_upload_body_done(u);
+            continue;
+        }
+
+        long long size = 0;
+        size_t i;
+        for (i = 0; i < line_len && i < 15; i++) {
+            int v = hex_value(line[i]);
+            if (v < 0) break;
+            size = size << 4 | v;
+        }
+        if (0 == i || (i < line_len && ';' != line[i] && ' ' != line[i] && '\t' != line[i])) {
+            redis_upload_reject(u);
+            return -1;
+        }
+
+        if (0 == size) {
+            u->state = REDIS_UPLOAD_TRAILER;
+            continue;
+        }
+
+        char digits[20];
+        size_t digits_len = http_u64toa(digits, size);
+        redis_upload_send(u, u->append, sdslen(u->append));
+        redis_upload_send(u, digits, digits_len);
+        redis_upload_send(u, "\r\n", 2);
+        u->replies++;
+        u->remaining = size;
+        u->state = REDIS_UPLOAD_CHUNK_DATA;
+    }
+
+    /* the client is making progress */
+    if (p != start && conn->upload && u->state < REDIS_UPLOAD_COMMIT) {
+        http_conn_timer_set(conn, HTTP_TIMER_HEADER, http_header_timeout * 1000);
+    }
+    return p - start;
+}
+
+/*
+ * Send GET key for req. A request for a key that is already in flight just
+ * waits for that reply. With --mget-batch the key is collected instead and
+ * sent along with the other GETs of this loop iteration (or --mget-window-us)
+ * as a single MGET.
+ */
+static int redis_get(http_server_t* server, http_req_t* req, const char* key, size_t key_len, unsigned int hash) {
+    redis_flight_t* f = redis_flight_find(server, key, key_len, hash);
+    if (f) {
+        redis_flight_add_req(f, req);
+        return REDIS_OK;
+    }
+
+    redis_conn_t* rc = redis_pick(server);
+    if (NULL == rc) return REDIS_ERR;
+
+    if (redis_mget_batch <= 1) {
+        f = redis_flight_new(server, key, key_len, hash);
+        if (REDIS_OK != redisAsyncCommand(rc->context, redis_data_cb, f,
+                "GET %b", key, key_len)) {
+            redis_flight_respond(server, f, NULL);
+            return REDIS_ERR;
+        }
+        redis_flight_sent(rc, f);
+        redis_flight_add_req(f, req);
+        rc->inflight++;
+        return REDIS_OK;
+    }
+
+    redis_batch_t* batch = server->batch;
+    if (NULL == batch) {
+        batch = malloc(sizeof(redis_batch_t));
+        assert(batch);
+        batch->n       = 0;
+        batch->flights = malloc(sizeof(redis_flight_t*) * redis_mget_batch);
+        batch->argvlen = malloc(sizeof(size_t) * (redis_mget_batch + 1));
+        batch->keys    = sdsempty();
+        assert(batch->flights && batch->argvlen);
+        batch->argvlen[0] = 4;
+        server->batch = batch;
+
+        if (redis_mget_window_us > 0) {
+            ev_timer_set(&server->batch_timer, redis_mget_window_us / 1e6, 0.);
+            ev_timer_start(server->loop, &server->batch_timer);
+        }
+        else {
+            ev_prepare_start(server->loop, &server->batch_prepare);
+        }
+    }
+
+    f = redis_flight_new(server, key, key_len, hash);
+    redis_flight_add_req(f, req);
+
+    batch->flights[batch->n] = f;
+    batch->argvlen[batch->n + 1] = key_len;
+    batch->keys = sdscatlen(batch->keys, key, key_len);
+    batch->n++;
+
+    if (batch->n == redis_mget_batch) {
+        redis_batch_flush(server);
+    }
+    return REDIS_OK;
+}
+
+static void setup_sock(int fd, int tcp) {
+    int on = 1, r;
+
+    if (tcp) {
+        r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        assert(r == 0);
+    }
+    r = fcntl(fd, F_SETFL, O_NONBLOCK);
+    assert(r == 0);
+}
+
+static int header_is(const struct phr_header* h, const char* name, size_t name_len) {
+    return h->name_len == name_len && 0 == strncasecmp(h->name, name, name_len);
+}
+
+/* case-insensitive search of a token in a comma separated header value */
+static int header_has_token(const struct phr_header* h, const char* token, size_t token_len) {
+    const char* p   = h->value;
+    const char* end = h->value + h->value_len;
+
+    while (p < end) {
+        while (p < end && (' ' == *p || '\t' == *p || ',' == *p)) p++;
+        const char* s = p;
+        while (p < end && ',' != *p) p++;
+        const char* e = p;
+        while (e > s && (' ' == e[-1] || '\t' == e[-1])) e--;
+        if ((size_t)(e - s) == token_len && 0 == strncasecmp(s, token, token_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* bytes a JSON string needs for each byte beyond the byte itself */
+static const unsigned char JSON_EXTRA[256] = {
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 1, 1, 5, 5, 1, 5, 5, /* \t \n \r */
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* " */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, /* \ */
+};
+
+/* bytes json_escape writes for s, quotes included */
+static size_t json_escaped_len(const char* s, size_t len) {
+    const unsigned char* p = (const unsigned char*)s;
+    size_t n = len + 2;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        n += JSON_EXTRA[p[i]];
+    }
+    return n;
+}
+
+/* s as a JSON string at dst, returns the end of it. Plain runs are copied at once. */
+static char* json_escape(char* dst, const char* s, size_t len) {
+    const unsigned char* p   = (const unsigned char*)s;
+    const unsigned char* end = p + len;
+
+    *dst++ = '"';
+    while (p < end) {
+        const unsigned char* run = p;
+        while (p < end && 0 == JSON_EXTRA[*p]) p++;
+        memcpy(dst, run, p - run);
+        dst += p - run;
+        if (p == end) break;
+
+        unsigned char c = *p++;
+        *dst++ = '\\';
+        if ('\n' == c) {
+            *dst++ = 'n';
+        }
+        else if ('\r' == c) {
+            *dst++ = 'r';
+        }
+        else if ('\t' == c) {
+            *dst++ = 't';
+        }
+        else if (c < 0x20) {
+            memcpy(dst, "u00", 3);
+            dst[3] = HEX_DIGITS[c >> 4];
+            dst[4] = HEX_DIGITS[c & 0xf];
+            dst += 5;
+        }
+        else {
+            *dst++ = c;
+        }
+    }
+    *dst++ = '"';
+
+    return dst;
+}
+
+/* a bulk reply as a JSON string, anything else as null */
+static size_t json_value_len(const redisReply* e) {
+    return REDIS_REPLY_STRING == e->type ? json_escaped_len(e->str, e->len) : 4;
+}
+
+static char* json_value(char* dst, const redisReply* e) {
+    if (REDIS_REPLY_STRING == e->type) {
+        return json_escape(dst, e->str, e->len);
+    }
+    memcpy(dst, "null", 4);
+    return dst + 4;
+}
+
+static const char* const JSON_TYPE   = "Content-Type: application/json\r\n";
+static const char* const BINARY_TYPE = "Content-Type: application/octet-stream\r\n";
+
+/*
+ * /_mget response, the values in request order: a JSON array of strings
+ * and nulls, or for each value a 32 bit big endian length followed by the
+ * bytes, 0xffffffff for a missing key.
+ */
+static void http_req_respond_mget(http_req_t* req, redisReply* reply, int binary) {
+    size_t i, len = binary ? 0 : 2;
+
+    if (!http_req_replied(req, reply)) return;
+
+    if (REDIS_REPLY_ARRAY != reply->type) {
+        fprintf(stderr, "unexpected MGET reply type %d\n", reply->type);
+        http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+        return;
+    }
+
+    /* sized up front, the body is written in one go */
+    for (i = 0; i < reply->elements; i++) {
+        redisReply* e = reply->element[i];
+        int found = REDIS_REPLY_STRING == e->type;
+
+        if (binary) {
+            len += 4 + (found ? e->len : 0);
+        }
+        else {
+            len += (i ? 1 : 0) + json_value_len(e);
+        }
+    }
+
+    buffer* body = buffer_init();
+    buffer_prepare_copy(body, len + 1);
+    char* p = body->ptr;
+
+    if (!binary) *p++ = '[';
+    for (i = 0; i < reply->elements; i++) {
+        redisReply* e = reply->element[i];
+        int found = REDIS_REPLY_STRING == e->type;
+
+        if (binary) {
+            uint32_t n = found ? (uint32_t)e->len : 0xffffffff;
+            *p++ = n >> 24;
+            *p++ = n >> 16;
+            *p++ = n >> 8;
+            *p++ = n;
+            if (found) {
+                memcpy(p, e->str, e->len);
+                p += e->len;
+            }
+        }
+        else {
+            if (i) *p++ = ',';
+            p = json_value(p, e);
+        }
+    }
+    if (!binary) *p++ = ']';
+    body->used = p - body->ptr;
+    assert(body->used == len);
+
+    http_response_t resp;
+    const char* type = binary ? BINARY_TYPE : JSON_TYPE;
+
+    http_req_response_init(req, &resp, HTTP_STATUS_OK);
+    http_response_header(&resp, type, strlen(type));
+    http_response_content_length(&resp, len);
+    http_response_append(&resp, body->ptr, body->used);
+    http_req_respond(req, resp.v, resp.n);
+
+    buffer_free(body);
+}
+
+static void redis_mget_keys_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    redis_mget_t* m = (redis_mget_t*)privdata;
+
+    rc->inflight--;
+
+    if (m->req) {
+        m->req->mget = NULL;
+        http_req_respond_mget(m->req, (redisReply*)r, m->binary);
+    }
+    free(m);
+}
+
+/*
+ * Key or field of /_mget and /h/ appended to s, path or query alike. Only
+ * %XX is decoded, a + stays a +. Plain /KEY paths are used as they are.
+ */
+static sds key_decode(sds s, const char* p, size_t len) {
+    const char* end = p + len;
+
+    while (p < end) {
+        const char* q = memchr(p, '%', end - p);
+        if (NULL == q) q = end;
+        s = sdscatlen(s, p, q - p);
+        if (q == end) break;
+
+        if (end - q >= 3 && hex_value(q[1]) >= 0 && hex_value(q[2]) >= 0) {
+            char c = hex_value(q[1]) << 4 | hex_value(q[2]);
+            s = sdscatlen(s, &c, 1);
+            p = q + 3;
+        }
+        else {
+            s = sdscatlen(s, q, 1);
+            p = q + 1;
+        }
+    }
+    return s;
+}
+
+/*
+ * GET /_mget?k=KEY&k=KEY... or POST /_mget with one key per line: all keys
+ * in a single MGET. format=binary in the query or an Accept header asking
+ * for application/octet-stream selects the length-prefixed framing.
+ * Returns HTTP_STATUS_OK once the MGET is sent, or the error to answer.
+ */
+static int http_req_mget(http_server_t* server, http_req_t* req, const char* query, size_t query_len,
+        const char* body, size_t body_len, const struct phr_header* headers, size_t num_headers) {
+    sds keys = sdsempty();
+    size_t nkeys = 0, keys_size = 16;
+    size_t* argvlen = malloc(sizeof(size_t) * (keys_size + 1));
+    int binary = 0;
+    size_t i;
+    assert(argvlen);
+
+    for (i = 0; i < num_headers; i++) {
+        if (header_is(&headers[i], "Accept", 6) &&
+                header_has_token(&headers[i], "application/octet-stream", 24)) {
+            binary = 1;
+        }
+    }
+
+    /* query parameters, then body lines */
+    const char* p   = query;
+    const char* end = query + query_len;
+    int in_body = 0;
+
+    for (;;) {
+        if (p >= end) {
+            if (in_body || NULL == body) break;
+            p   = body;
+            end = body + body_len;
+            in_body = 1;
+            continue;
+        }
+
+        const char* item_end = memchr(p, in_body ? '\n' : '&', end - p);
+        if (NULL == item_end) item_end = end;
+        const char* item = p;
+        size_t item_len  = item_end - item;
+        p = item_end + 1;
+
+        const char* value;
+        size_t value_len;
+        if (in_body) {
+            if (item_len && '\r' == item[item_len - 1]) item_len--;
+            if (0 == item_len) continue;
+            value     = item;
+            value_len = item_len;
+        }
+        else if (item_len > 2 && 0 == strncmp(item, "k=", 2)) {
+            value     = item + 2;
+            value_len = item_len - 2;
+        }
+        else {
+            if (13 == item_len && 0 == strncmp(item, "format=binary", 13)) binary = 1;
+            continue;
+        }
+
+        if (nkeys == keys_size) {
+            keys_size *= 2;
+            argvlen = realloc(argvlen, sizeof(size_t) * (keys_size + 1));
+            assert(argvlen);
+        }
+
+        size_t before = sdslen(keys);
+        if (in_body) {
+            keys = sdscatlen(keys, value, value_len);
+        }
+        else {
+            keys = key_decode(keys, value, value_len);
+        }
+        argvlen[++nkeys] = sdslen(keys) - before;
+    }
+
+    int status = HTTP_STATUS_BAD_REQUEST;
+    redis_conn_t* rc = nkeys ? redis_pick(server) : NULL;
+
+    if (nkeys && NULL == rc) {
+        status = HTTP_STATUS_BAD_GATEWAY;
+    }
+    else if (rc) {
+        const char** argv = malloc(sizeof(char*) * (nkeys + 1));
+        assert(argv);
+        const char* key = keys;
+
+        argv[0]    = "MGET";
+        argvlen[0] = 4;
+        for (i = 1; i <= nkeys; i++) {
+            argv[i] = key;
+            key += argvlen[i];
+        }
+
+        redis_mget_t* m = malloc(sizeof(redis_mget_t));
+        assert(m);
+        m->req    = req;
+        m->binary = binary;
+
+        status = HTTP_STATUS_BAD_GATEWAY;
+        if (REDIS_OK == redisAsyncCommandArgv(rc->context, redis_mget_keys_cb, m,
+                nkeys + 1, argv, argvlen)) {
+            req->mget = m;
+            rc->inflight++;
+            status = HTTP_STATUS_OK;
+        }
+        else {
+            free(m);
+        }
+        free(argv);
+    }
+
+    free(argvlen);
+    sdsfree(keys);
+
+    return status;
+}
+
+static void redis_hash_free(redis_hash_t* h) {
+    free(h->argvlen);
+    sdsfree(h->args);
+    free(h);
+}
+
+/*
+ * HMGET and HGETALL answers as one JSON object of strings, null for fields
+ * missing in HMGET. The body is sized first and escaped in a single pass.
+ */
+static void http_req_respond_hash(http_req_t* req, redisReply* reply, redis_hash_t* h) {
+    int hgetall = 2 == h->argc;
+    size_t nfields = hgetall ? 0 : h->argc - 2;
+    size_t i, len = 2;
+
+    if (!http_req_replied(req, reply)) return;
+
+    if (REDIS_REPLY_ARRAY != reply->type ||
+            (hgetall ? reply->elements % 2 : reply->elements != nfields)) {
+        fprintf(stderr, "unexpected %s reply type %d\n", hgetall ? "HGETALL" : "HMGET", reply->type);
+        http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+        return;
+    }
+
+    /* an empty HGETALL is a missing key */
+    if (hgetall) {
+        if (0 == reply->elements) {
+            http_req_respond_not_found(req);
+            return;
+        }
+        nfields = reply->elements / 2;
+    }
+
+    const char* field = h->args + h->argvlen[1];
+    for (i = 0; i < nfields; i++) {
+        if (hgetall) {
+            len += json_value_len(reply->element[2 * i]) + 1 + json_value_len(reply->element[2 * i + 1]);
+        }
+        else {
+            len += json_escaped_len(field, h->argvlen[i + 2]) + 1 + json_value_len(reply->element[i]);
+            field += h->argvlen[i + 2];
+        }
+        if (i) len++;
+    }
+
+    buffer* body = buffer_init();
+    buffer_prepare_copy(body, len + 1);
+    char* p = body->ptr;
+
+    field = h->args + h->argvlen[1];
+    *p++ = '{';
+    for (i = 0; i < nfields; i++) {
+        if (i) *p++ = ',';
+        if (hgetall) {
+            p = json_value(p, reply->element[2 * i]);
+            *p++ = ':';
+            p = json_value(p, reply->element[2 * i + 1]);
+        }
+        else {
+            p = json_escape(p, field, h->argvlen[i + 2]);
+            field += h->argvlen[i + 2];
+            *p++ = ':';
+            p = json_value(p, reply->element[i]);
+        }
+    }
+    *p++ = '}';
+    body->used = p - body->ptr;
+    assert(body->used == len);
+
+    http_response_t resp;
+
+    http_req_response_init(req, &resp, HTTP_STATUS_OK);
+    http_response_header(&resp, JSON_TYPE, strlen(JSON_TYPE));
+    http_response_content_length(&resp, len);
+    http_response_append(&resp, body->ptr, body->used);
+    http_req_respond(req, resp.v, resp.n);
+
+    buffer_free(body);
+}
+
+static void redis_hash_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    redis_hash_t* h = (redis_hash_t*)privdata;
+    redisReply* reply = r;
+
+    rc->inflight--;
+
+    if (h->req) {
+        http_req_t* req = h->req;
+        req->hash = NULL;
+
+        if (h->hget) {
+            /* a single field is sent as is, like a GET */
+            uint64_t etag = 0;
+            int tagged = http_etag && reply && REDIS_REPLY_STRING == reply->type && reply->len;
+            if (tagged) {
+                etag = http_etag_hash(reply->str, reply->len);
+            }
+            http_req_respond_reply(req, reply, tagged ? &etag : NULL);
+        }
+        else {
+            http_req_respond_hash(req, reply, h);
+        }
+    }
+    redis_hash_free(h);
+}
+
+/*
+ * /h/KEY/FIELD is HGET, /h/KEY?f=FIELD&f=FIELD... HMGET and /h/KEY HGETALL.
+ * Key and fields are %XX decoded, so they can hold a slash. Returns
+ * HTTP_STATUS_OK once the command is sent, or the error to answer.
+ */
+static int http_req_hash(http_server_t* server, http_req_t* req, const char* path, size_t path_len) {
+    const char* query = memchr(path, '?', path_len);
+    const char* end   = query ? query : path + path_len;
+    const char* slash = memchr(path, '/', end - path);
+    const char* key_end = slash ? slash : end;
+    size_t args_size = 8;
+    int argc = 2;
+
+    if (key_end == path || (slash && slash + 1 == end)) return HTTP_STATUS_BAD_REQUEST;
+
+    redis_hash_t* h = malloc(sizeof(redis_hash_t));
+    assert(h);
+    h->req     = req;
+    h->hget    = NULL != slash;
+    h->args    = key_decode(sdsempty(), path, key_end - path);
+    h->argvlen = malloc(sizeof(size_t) * args_size);
+    assert(h->argvlen);
+    h->argvlen[1] = sdslen(h->args);
+
+    if (slash) {
+        h->args = key_decode(h->args, slash + 1, end - slash - 1);
+        h->argvlen[argc++] = sdslen(h->args) - h->argvlen[1];
+    }
+    else if (query) {
+        const char* p = query + 1;
+        const char* query_end = path + path_len;
+
+        while (p < query_end) {
+            const char* item = p;
+            const char* item_end = memchr(p, '&', query_end - p);
+            if (NULL == item_end) item_end = query_end;
+            p = item_end + 1;
+
+            if (item_end - item <= 2 || 0 != strncmp(item, "f=", 2)) continue;
+
+            if ((size_t)argc == args_size) {
+                args_size *= 2;
+                h->argvlen = realloc(h->argvlen, sizeof(size_t) * args_size);
+                assert(h->argvlen);
+            }
+
+            size_t before = sdslen(h->args);
+            h->args = key_decode(h->args, item + 2, item_end - item - 2);
+            h->argvlen[argc++] = sdslen(h->args) - before;
+        }
+    }
+    h->argc = argc;
+
+    redis_conn_t* rc = redis_pick(server);
+    if (NULL == rc) {
+        redis_hash_free(h);
+        return HTTP_STATUS_BAD_GATEWAY;
+    }
+
+    const char** argv = malloc(sizeof(char*) * argc);
+    assert(argv);
+    const char* arg = h->args;
+    int i;
+
+    argv[0] = h->hget ? "HGET" : 2 == argc ? "HGETALL" : "HMGET";
+    h->argvlen[0] = strlen(argv[0]);
+    for (i = 1; i < argc; i++) {
+        argv[i] = arg;
+        arg += h->argvlen[i];
+    }
+
+    int status = HTTP_STATUS_BAD_GATEWAY;
+    if (REDIS_OK == redisAsyncCommandArgv(rc->context, redis_hash_cb, h, argc, argv, h->argvlen)) {
+        req->hash = h;
+        rc->inflight++;
+        status = HTTP_STATUS_OK;
+    }
+    else {
+        redis_hash_free(h);
+    }
+    free(argv);
+
+    return status;
+}
+
+/*
+ * Range: bytes=... into ranges, returns how many. 0 when there is no Range
+ * header, it is not a valid bytes range set or it has more than
+ * HTTP_RANGES_MAX ranges, the whole value is sent then.
+ */
+static int http_request_range(const struct phr_header* headers, size_t num_headers,
+        http_range_t* ranges) {
+    const struct phr_header* h = NULL;
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < num_headers; i++) {
+        if (header_is(&headers[i], "Range", 5)) h = &headers[i];
+    }
+    if (NULL == h || h->value_len < 6 || 0 != strncasecmp(h->value, "bytes=", 6)) return 0;
+
+    const char* p   = h->value + 6;
+    const char* end = h->value + h->value_len;
+
+    while (p < end) {
+        while (p < end && (' ' == *p || '\t' == *p || ',' == *p)) p++;
+        if (p == end) break;
+        if (n == HTTP_RANGES_MAX) return 0;
+
+        /* at most 18 digits each, no overflow */
+        long long first = -1, last = -1;
+        int digits;
+
+        for (digits = 0; p < end && *p >= '0' && *p <= '9' && digits < 18; p++, digits++) {
+            first = (digits ? first * 10 : 0) + (*p - '0');
+        }
+        if (p == end || '-' != *p++) return 0;
+        for (digits = 0; p < end && *p >= '0' && *p <= '9' && digits < 18; p++, digits++) {
+            last = (digits ? last * 10 : 0) + (*p - '0');
+        }
+        while (p < end && (' ' == *p || '\t' == *p)) p++;
+        if (p < end && ',' != *p) return 0;
+
+        /* "-" alone or LAST before FIRST, an empty suffix "-0" is unsatisfiable */
+        if (first < 0 && last < 0) return 0;
+        if (first >= 0 && last >= 0 && last < first) return 0;
+
+        ranges[n].first = first;
+        ranges[n].last  = last;
+        n++;
+    }
+    return n;
+}
+
+static const char* const MULTIPART_TYPE = "Content-Type: multipart/byteranges; boundary=";
+static const char* const PART_TYPE      = "\r\nContent-Type: application/octet-stream\r\n";
+
+/*
+ * Range GET response from [STRLEN, GETRANGE...]. Ranges starting past the
+ * end come back empty and are left out, a single range is sent as is and
+ * several as multipart/byteranges.
+ */
+static void http_req_respond_range(http_req_t* req, redisReply* reply,
+        const http_range_t* ranges, int n) {
+    http_server_t* server = req->conn->server;
+    int i;
+
+    if (!http_req_replied(req, reply)) return;
+
+    int valid = REDIS_REPLY_ARRAY == reply->type && reply->elements == (size_t)n + 1 &&
+        REDIS_REPLY_INTEGER == reply->element[0]->type;
+    for (i = 0; valid && i < n; i++) {
+        valid = REDIS_REPLY_STRING == reply->element[i + 1]->type;
+    }
+    if (!valid) {
+        fprintf(stderr, "unexpected Range reply type %d\n", reply->type);
+        http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+        return;
+    }
+
+    long long total = reply->element[0]->integer;
+    if (total <= 0) {
+        http_req_respond_not_found(req);
+        return;
+    }
+
+    /* offsets of the satisfiable ranges, GETRANGE clamped the rest */
+    redisReply* parts[HTTP_RANGES_MAX];
+    long long firsts[HTTP_RANGES_MAX];
+    int nparts = 0;
+
+    for (i = 0; i < n; i++) {
+        redisReply* e = reply->element[i + 1];
+        if (0 == e->len) continue;
+
+        if (ranges[i].first >= 0) {
+            firsts[nparts] = ranges[i].first;
+        }
+        else {
+            firsts[nparts] = ranges[i].last < total ? total - ranges[i].last : 0;
+        }
+        parts[nparts++] = e;
+    }
+
+    http_response_t resp;
+    char content_range[HTTP_CONTENT_RANGE_MAX];
+
+    if (0 == nparts) {
+        http_req_response_init(req, &resp, HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+        http_response_header(&resp, content_range,
+            http_response_format_content_range(content_range, 1, 0, total));
+        http_response_text_body(&resp, HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+        http_req_respond(req, resp.v, resp.n);
+        return;
+    }
+
+    http_req_response_init(req, &resp, HTTP_STATUS_PARTIAL_CONTENT);
+
+    if (1 == nparts) {
+        http_response_header(&resp, content_range,
+            http_response_format_content_range(content_range,
+                firsts[0], firsts[0] + parts[0]->len - 1, total));
+        http_response_content_length(&resp, parts[0]->len);
+        http_response_append(&resp, parts[0]->str, parts[0]->len);
+        http_req_respond(req, resp.v, resp.n);
+        return;
+    }
+
+    /* part headers back to back in hdrs, the values are written from the reply */
+    char boundary[16];
+    http_server_unique(server, boundary);
+
+    size_t type_len = strlen(MULTIPART_TYPE);
+    size_t part_len = strlen(PART_TYPE);
+    char type[type_len + sizeof(boundary) + 2];
+    memcpy(type, MULTIPART_TYPE, type_len);
+    memcpy(type + type_len, boundary, sizeof(boundary));
+    memcpy(type + type_len + sizeof(boundary), "\r\n", 2);
+    http_response_header(&resp, type, sizeof(type));
+
+    char hdrs[(4 + sizeof(boundary) + part_len + HTTP_CONTENT_RANGE_MAX + 2) * HTTP_RANGES_MAX +
+        4 + sizeof(boundary) + 4];
+    char* p = hdrs;
+    struct iovec v[HTTP_RESPONSE_MAX_IOV + 2 * HTTP_RANGES_MAX + 1];
+    int nv = 0;
+    size_t len = 0;
+
+    for (i = 0; i < nparts; i++) {
+        char* part = p;
+        memcpy(p, "\r\n--", 4);
+        memcpy(p + 4, boundary, sizeof(boundary));
+        p += 4 + sizeof(boundary);
+        memcpy(p, PART_TYPE, part_len);
+        p += part_len;
+        p += http_response_format_content_range(p,
+            firsts[i], firsts[i] + parts[i]->len - 1, total);
+        memcpy(p, "\r\n", 2);
+        p += 2;
+
+        v[nv].iov_base   = part;
+        v[nv++].iov_len  = p - part;
+        v[nv].iov_base   = parts[i]->str;
+        v[nv++].iov_len  = parts[i]->len;
+        len += (p - part) + parts[i]->len;
+    }
+    char* tail = p;
+    memcpy(p, "\r\n--", 4);
+    memcpy(p + 4, boundary, sizeof(boundary));
+    memcpy(p + 4 + sizeof(boundary), "--\r\n", 4);
+    p += 4 + sizeof(boundary) + 4;
+    v[nv].iov_base  = tail;
+    v[nv++].iov_len = p - tail;
+    len += p - tail;
+
+    http_response_content_length(&resp, len);
+
+    struct iovec all[HTTP_RESPONSE_MAX_IOV + 2 * HTTP_RANGES_MAX + 1];
+    memcpy(all, resp.v, sizeof(struct iovec) * resp.n);
+    memcpy(all + resp.n, v, sizeof(struct iovec) * nv);
+    http_req_respond(req, all, resp.n + nv);
+}
+
+static void redis_range_cb(redisAsyncContext* c, void* r, void* privdata) {
+    redis_conn_t* rc = (redis_conn_t*)c->data;
+    redis_range_t* m = (redis_range_t*)privdata;
+
+    rc->inflight--;
+
+    if (m->req) {
+        m->req->range = NULL;
+        http_req_respond_range(m->req, (redisReply*)r, m->ranges, m->n);
+    }
+    free(m);
+}
+
+/*
+ * Only the requested bytes of key: STRLEN for the Content-Range total and a
+ * GETRANGE per range, in one MULTI/EXEC so they see the same value. Ranges
+ * bypass the cache, single-flight and streaming.
+ */
+static int redis_range_get(http_server_t* server, http_req_t* req, const char* key, size_t key_len,
+        const http_range_t* ranges, int n) {
+    redis_conn_t* rc = redis_pick(server);
+    if (NULL == rc) return REDIS_ERR;
+
+    const char* argv[4] = { "STRLEN", key, NULL, NULL };
+    size_t argvlen[4]   = { 6, key_len, 0, 0 };
+    char first[24], last[24];
+    int i;
+
+    int status = redisAsyncCommand(rc->context, NULL, NULL, "MULTI");
+    if (REDIS_OK == status) {
+        status = redisAsyncCommandArgv(rc->context, NULL, NULL, 2, argv, argvlen);
+    }
+
+    argv[0]    = "GETRANGE";
+    argvlen[0] = 8;
+    argv[2]    = first;
+    argv[3]    = last;
+    for (i = 0; i < n && REDIS_OK == status; i++) {
+        /* suffixes and open ends as negative offsets, "-0" as an empty range */
+        if (ranges[i].first < 0 && 0 == ranges[i].last) {
+            memcpy(first, "1", 1);
+            memcpy(last, "0", 1);
+            argvlen[2] = argvlen[3] = 1;
+            status = redisAsyncCommandArgv(rc->context, NULL, NULL, 4, argv, argvlen);
+            continue;
+        }
+        if (ranges[i].first < 0) {
+            first[0]   = '-';
+            argvlen[2] = 1 + http_u64toa(first + 1, ranges[i].last);
+        }
+        else {
+            argvlen[2] = http_u64toa(first, ranges[i].first);
+        }
+        if (ranges[i].first < 0 || ranges[i].last < 0) {
+            memcpy(last, "-1", 2);
+            argvlen[3] = 2;
+        }
+        else {
+            argvlen[3] = http_u64toa(last, ranges[i].last);
+        }
+        status = redisAsyncCommandArgv(rc->context, NULL, NULL, 4, argv, argvlen);
+    }
+    if (REDIS_OK != status) return REDIS_ERR;
+
+    redis_range_t* m = malloc(sizeof(redis_range_t));
+    assert(m);
+    m->req = req;
+    m->n   = n;
+    memcpy(m->ranges, ranges, sizeof(http_range_t) * n);
+
+    if (REDIS_OK != redisAsyncCommand(rc->context, redis_range_cb, m, "EXEC")) {
+        free(m);
+        return REDIS_ERR;
+    }
+    req->range = m;
+    rc->inflight++;
+
+    return REDIS_OK;
+}
+
+/* request body length from Content-Length, -1 unless it is framed that way */
+static long long http_request_body_len(const struct phr_header* headers, size_t num_headers) {
+    long long len = 0;
+    size_t i, j;
+
+    for (i = 0; i < num_headers; i++) {
+        if (header_is(&headers[i], "Transfer-Encoding", 17)) return -1;
+        if (!header_is(&headers[i], "Content-Length", 14)) continue;
+
+        if (0 == headers[i].value_len || headers[i].value_len > 18) return -1;
+        for (len = 0, j = 0; j < headers[i].value_len; j++) {
+            char c = headers[i].value[j];
+            if (c < '0' || c > '9') return -1;
+            len = len * 10 + (c - '0');
+        }
+    }
+    return len;
+}
+
+/* seconds from at most 9 digits, -1 unless that is all there is */
+static long long http_parse_seconds(const char* p, size_t len) {
+    long long n = 0;
+    size_t i;
+
+    if (0 == len || len > 9) return -1;
+    for (i = 0; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9') return -1;
+        n = n * 10 + (p[i] - '0');
+    }
+    return n;
+}
+
+/*
+ * PUT or POST /KEY[?ttl=SECONDS]: the body becomes the value of KEY, with the
+ * TTL from the query or an X-TTL header. The body is read by
+ * redis_upload_feed, buffered is how much of it is in rbuf already.
+ * Returns HTTP_STATUS_OK once the upload started, or the error to answer.
+ */
+static int http_req_upload(http_server_t* server, http_req_t* req, const char* path, size_t path_len,
+        int minor_version, long long body_len, size_t buffered,
+        const struct phr_header* headers, size_t num_headers) {
+    const char* query = memchr(path, '?', path_len);
+    size_t key_len    = (query ? query : path + path_len) - path - 1;
+    long long ttl = 0;
+    int chunked = 0, expect = 0;
+    size_t i;
+
+    if (0 == key_len) return HTTP_STATUS_BAD_REQUEST;
+
+    for (i = 0; i < num_headers; i++) {
+        if (header_is(&headers[i], "X-TTL", 5)) {
+            ttl = http_parse_seconds(headers[i].value, headers[i].value_len);
+            if (ttl < 0) return HTTP_STATUS_BAD_REQUEST;
+        }
+        else if (header_is(&headers[i], "Transfer-Encoding", 17)) {
+            chunked = header_has_token(&headers[i], "chunked", 7);
+        }
+        else if (header_is(&headers[i], "Expect", 6)) {
+            expect = header_has_token(&headers[i], "100-continue", 12);
+        }
+    }
+
+    if (query) {
+        const char* p   = query + 1;
+        const char* end = path + path_len;
+
+        while (p < end) {
+            const char* item = p;
+            const char* item_end = memchr(p, '&', end - p);
+            if (NULL == item_end) item_end = end;
+            p = item_end + 1;
+
+            if (item_end - item < 4 || 0 != strncmp(item, "ttl=", 4)) continue;
+            ttl = http_parse_seconds(item + 4, item_end - item - 4);
+            if (ttl < 0) return HTTP_STATUS_BAD_REQUEST;
+        }
+    }
+
+    if (body_len < 0 && !chunked) return HTTP_STATUS_LENGTH_REQUIRED;
+
+    int status = redis_upload_start(server, req, path + 1, key_len, chunked ? -1 : body_len, ttl);
+    if (HTTP_STATUS_OK != status) return status;
+
+    /* interim response, unless earlier responses still have to go first */
+    http_conn_t* conn = req->conn;
+    if (expect && minor_version >= 1 && 0 == buffered &&
+            ngx_queue_head(&conn->requests) == &req->queue) {
+        static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        struct iovec v = { (char*)CONTINUE, sizeof(CONTINUE) - 1 };
+        http_conn_write(conn, &v, 1);
+    }
+    return HTTP_STATUS_OK;
+}
+
+/* HTTP/1.1 defaults to persistent connections, HTTP/1.0 needs to ask for it */
+static int http_request_keepalive(int minor_version,
+        const struct phr_header* headers, size_t num_headers) {
+    int keepalive = minor_version >= 1;
+    size_t i;
+
+    for (i = 0; i < num_headers; i++) {
+        if (!header_is(&headers[i], "Connection", 10)) continue;
+
+        if (header_has_token(&headers[i], "close", 5)) {
+            keepalive = 0;
+        }
+        else if (header_has_token(&headers[i], "keep-alive", 10)) {
+            keepalive = 1;
+        }
+    }
+    return keepalive;
+}
+
+/*
+ * --etag: remember the entity tags of If-None-Match for the response, weak
+ * ones included. Tags not produced by http_response_format_etag can never
+ * match and are skipped.
+ */
+static void http_request_if_none_match(http_req_t* req,
+        const struct phr_header* headers, size_t num_headers) {
+    size_t i;
+
+    for (i = 0; i < num_headers; i++) {
+        if (!header_is(&headers[i], "If-None-Match", 13)) continue;
+
+        const char* p   = headers[i].value;
+        const char* end = headers[i].value + headers[i].value_len;
+
+        while (p < end) {
+            while (p < end && (' ' == *p || '\t' == *p || ',' == *p)) p++;
+            const char* s = p;
+            while (p < end && ',' != *p) p++;
+            const char* e = p;
+            while (e > s && (' ' == e[-1] || '\t' == e[-1])) e--;
+
+            if (1 == e - s && '*' == *s) {
+                req->flags = req->flags | HTTP_REQ_ETAG_ANY;
+                continue;
+            }
+            if (e - s >= 2 && 'W' == s[0] && '/' == s[1]) s += 2;
+            if (18 != e - s || '"' != s[0] || '"' != s[17]) continue;
+
+            uint64_t etag = 0;
+            int j;
+            for (j = 1; j <= 16; j++) {
+                int v = hex_value(s[j]);
+                if (v < 0) break;
+                etag = etag << 4 | v;
+            }
+            if (j <= 16 || req->netags == HTTP_REQ_ETAGS) continue;
+            req->etags[req->netags++] = etag;
+        }
+    }
+}
+
+/*
+ * Parse and dispatch every complete request in rbuf. Responses are queued on
+ * conn->requests in the same order, so many redis round trips can be in
+ * flight for one connection.
+ */
+static void http_conn_parse(http_conn_t* conn) {
+    size_t off = 0;
+    int answered = 0;
+    int r;
+
+    /* the rest of a body being uploaded comes first */
+    if (conn->upload && conn->upload->state < REDIS_UPLOAD_COMMIT) {
+        ssize_t n = redis_upload_feed(conn, conn->rbuf->ptr, conn->rbuf->used);
+        if (n < 0) return;
+        off = n;
+    }
+
+    while (NULL == conn->upload && off < conn->rbuf->used && http_conn_readable(conn)) {
+        const char* method;
+        const char* path;
+        size_t method_len, path_len;
+        int minor_version;
+        size_t num_headers = 20;
+        struct phr_header headers[num_headers];
+        http_range_t ranges[HTTP_RANGES_MAX];
+        int nranges;
+
+        r = phr_parse_request(conn->rbuf->ptr + off, conn->rbuf->used - off,
+            &method, &method_len, &path, &path_len, &minor_version,
+            headers, &num_headers, conn->last_len);
+
+        if (-2 == r) {
+            /* partial, only the new bytes are scanned next time */
+            conn->last_len = conn->rbuf->used - off;
+            break;
+        }
+        else if (-1 == r) {
+            conn->flags = conn->flags | HTTP_CONN_LAST;
+            http_req_t* req = http_req_init(conn, 0, 0);
+            http_req_respond_error(req, HTTP_STATUS_BAD_REQUEST);
+            return;
+        }
+
+        int get  = 3 == method_len && 0 == strncmp(method, "GET", method_len);
+        int post = 4 == method_len && 0 == strncmp(method, "POST", method_len);
+        int put  = 3 == method_len && 0 == strncmp(method, "PUT", method_len);
+
+        int mget = path_len >= 6 && 0 == strncmp(path, "/_mget", 6) &&
+            (6 == path_len || '?' == path[6]);
+        int hash_route = path_len > 3 && 0 == strncmp(path, "/h/", 3);
+
+        /* bodies of PUT and POST to a key go to redis as they arrive, others are read whole */
+        int upload = (put || post) && !mget && !hash_route && path_len > 1;
+
+        long long body_len = http_request_body_len(headers, num_headers);
+        if (!upload && body_len > 0 && body_len <= HTTP_BODY_MAX &&
+                conn->rbuf->used - off - r < (size_t)body_len) {
+            /* headers are scanned again once the body is complete */
+            conn->last_len = 0;
+            break;
+        }
+        const char* body = conn->rbuf->ptr + off + r;
+
+        off += r;
+        conn->last_len = 0;
+
+        int keepalive = http_request_keepalive(minor_version, headers, num_headers);
+        if (!keepalive) {
+            conn->flags = conn->flags | HTTP_CONN_LAST;
+        }
+
+        http_req_t* req = http_req_init(conn, minor_version, keepalive);
+
+        if (upload) {
+            int status = http_req_upload(conn->server, req, path, path_len, minor_version, body_len,
+                conn->rbuf->used - off, headers, num_headers);
+            if (HTTP_STATUS_OK != status) {
+                conn->flags = conn->flags | HTTP_CONN_LAST;
+                http_req_respond_error(req, status);
+                return;
+            }
+            conn->waiting++;
+
+            ssize_t n = redis_upload_feed(conn, conn->rbuf->ptr + off, conn->rbuf->used - off);
+            if (n < 0) return;
+            off += n;
+            continue;
+        }
+
+        if (body_len < 0 || body_len > HTTP_BODY_MAX) {
+            conn->flags = conn->flags | HTTP_CONN_LAST;
+            http_req_respond_error(req, body_len < 0
+                ? HTTP_STATUS_LENGTH_REQUIRED : HTTP_STATUS_PAYLOAD_TOO_LARGE);
+            return;
+        }
+        off += body_len;
+
+        /* GET /KEY, the raw path is the key */
+        const char* key = path + 1;
+        size_t key_len  = path_len - 1;
+
+        if ((get || post) && mget) {
+            const char* query = 6 == path_len ? path + path_len : path + 7;
+            int status = http_req_mget(conn->server, req, query, path + path_len - query,
+                post ? body : NULL, body_len, headers, num_headers);
+            if (HTTP_STATUS_OK == status) {
+                conn->waiting++;
+            }
+            else {
+                conn->flags = conn->flags | HTTP_CONN_LAST;
+                http_req_respond_error(req, status);
+                return;
+            }
+        }
+        else if (get && hash_route) {
+            if (http_etag) {
+                http_request_if_none_match(req, headers, num_headers);
+            }
+
+            int status = http_req_hash(conn->server, req, path + 3, path_len - 3);
+            if (HTTP_STATUS_OK == status) {
+                conn->waiting++;
+            }
+            else {
+                conn->flags = conn->flags | HTTP_CONN_LAST;
+                http_req_respond_error(req, status);
+                return;
+            }
+        }
+        else if (get && path_len > 1 &&
+                (nranges = http_request_range(headers, num_headers, ranges)) > 0) {
+            if (REDIS_OK == redis_range_get(conn->server, req, key, key_len, ranges, nranges)) {
+                conn->waiting++;
+            }
+            else {
+                conn->flags = conn->flags | HTTP_CONN_LAST;
+                http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+                return;
+            }
+        }
+        else if (get && path_len > 1) {
+            if (http_etag) {
+                http_request_if_none_match(req, headers, num_headers);
+            }
+
+            unsigned int hash = redis_key_hash(key, key_len);
+            cache_entry_t* e = NULL;
+            if (cache_size) {
+                e = cache_get(conn->server, key, key_len, hash);
+            }
+
+            if (e) {
+                http_req_respond_cached(req, e);
+                answered = 1;
+            }
+            else if (redis_stream_threshold &&
+                    REDIS_OK == redis_stream_get(conn->server, req, key, key_len, hash)) {
+                conn->waiting++;
+            }
+            else if (REDIS_OK == redis_get(conn->server, req, key, key_len, hash)) {
+                conn->waiting++;
+            }
+            else {
+                conn->flags = conn->flags | HTTP_CONN_LAST;
+                http_req_respond_error(req, HTTP_STATUS_BAD_GATEWAY);
+                return;
+            }
+        }
+        else {
+            conn->flags = conn->flags | HTTP_CONN_LAST;
+            http_req_respond_error(req, HTTP_STATUS_BAD_REQUEST);
+            return;
+        }
+    }
+
+    if (off) {
+        memmove(conn->rbuf->ptr, conn->rbuf->ptr + off, conn->rbuf->used - off);
+        conn->rbuf->used -= off;
+    }
+
+    if (!http_conn_readable(conn)) {
+        /* resumed by http_conn_flush */
+        ev_io_stop(conn->server->loop, &conn->ev_read);
+    }
+
+    http_conn_timer_update(conn);
+
+    /* cache hits, may close conn */
+    if (answered) {
+        http_conn_flush(conn);
+    }
+}
+
+static void http_conn_read_cb(EV_P_ ev_io* w, int revents) {
+    http_conn_t* conn = (http_conn_t*)
+        (((char*)w) - offsetof(http_conn_t, ev_read));
+    //http_server_t* server = conn->server;
+
+    buffer* rbuf = conn->rbuf;
+    size_t got = 0;
+    ssize_t r;
+
+    /* straight into rbuf, doubling it as needed, until the socket is drained */
+    while (got < HTTP_CONN_READ_BUDGET) {
+        if (rbuf->size - rbuf->used < HTTP_CONN_READ_MIN) {
+            buffer_prepare_append(rbuf,
+                rbuf->used > HTTP_CONN_READ_MIN ? rbuf->used : HTTP_CONN_READ_MIN);
+        }
+
+        size_t avail = rbuf->size - rbuf->used;
+        r = read(w->fd, rbuf->ptr + rbuf->used, avail);
+        if (r <= 0) break;
+
+        rbuf->used += r;
+        got += r;
+        if ((size_t)r < avail) break;
+    }
+
+    if (got) {
+        /* EOF or errors after the data are seen on the next wakeup */
+        http_conn_parse(conn);
+        return;
+    }
+
+    if (0 == r) {
+        /* connection closed by peer */
+#ifdef DEBUG
+        fprintf(stderr, "connection closed by peer: %d\n", w->fd);
+#endif
+        if (ngx_queue_empty(&conn->requests) ||
+                (conn->upload && conn->upload->state < REDIS_UPLOAD_COMMIT)) {
+            conn->flags = conn->flags | HTTP_CONN_ERR;
+            http_conn_close(conn);
+        }
+        else {
+            /* half close, answer what has been asked already */
+            conn->flags = conn->flags | HTTP_CONN_LAST;
+            ev_io_stop(EV_A_ &conn->ev_read);
+        }
+        return;
+    }
+    else if (-1 == r) {
+        /* error */
+        if (EAGAIN == errno || EWOULDBLOCK == errno) { /* try again later */
+            return;
+        }
+        else { /* fatal error */
+#ifdef DEBUG
+            fprintf(stderr, "fatal error: %d, %s\n", errno, strerror(errno));
+#endif
+            conn->flags = conn->flags | HTTP_CONN_ERR;
+            http_conn_close(conn);
+            return;
+        }
+    }
+}
+
+static void http_acccept_cb(EV_P_ ev_io* w, int revents) {
+    http_listen_t* ls = (http_listen_t*)
+        (((char*)w) - offsetof(http_listen_t, ev_read));
+    http_server_t* server = ls->server;
+    int i;
+
+    /* drain the backlog, up to --accept-batch per wakeup */
+    for (i = 0; i < http_accept_batch; i++) {
+        /* the rest waits in the backlog until a connection closes */
+        if (http_max_connections > 0 && server->nconns >= http_max_connections) {
+            http_server_accept_pause(server);
+            return;
+        }
+
+#ifdef SOCK_NONBLOCK
+        /* TCP_NODELAY is inherited from the listening socket */
+        int newfd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int newfd = accept(w->fd, NULL, NULL);
+#endif
+        if (-1 == newfd) {
+            /* drained, or another worker sharing the socket got it first */
+            if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+                fprintf(stderr, "accept failed: %d, %s\n", errno, strerror(errno));
+            }
+            return;
+        }
+
+#ifndef SOCK_NONBLOCK
+        setup_sock(newfd, AF_UNIX != ls->listener->addr.ss_family);
+#endif
+
+        http_conn_t* conn = http_conn_init(server, newfd);
+        ngx_queue_insert_tail(&server->connections, &conn->queue);
+        server->nconns++;
+
+        ev_io_init(&conn->ev_read, http_conn_read_cb, newfd, EV_READ);
+        ev_io_init(&conn->ev_write, http_conn_write_cb, newfd, EV_WRITE);
+        ev_io_start(EV_A_ &conn->ev_read);
+        http_conn_timer_update(conn);
+
+#ifdef DEBUG
+        fprintf(stderr, "new connection: %d\n", newfd);
+#endif
+    }
+}
+
+static void sigterm_cb(EV_P_ ev_async* w, int revents);
+
+/* the connection timer ran out */
+static void http_conn_timeout(http_conn_t* conn) {
+    int phase = conn->timer_phase;
+    http_conn_timer_set(conn, HTTP_TIMER_NONE, 0);
+
+    if (HTTP_TIMER_REDIS != phase) {
+#ifdef DEBUG
+        fprintf(stderr, "%s timeout: %d\n", HTTP_TIMER_IDLE == phase ? "idle" : "header", conn->fd);
+#endif
+        conn->flags = conn->flags | HTTP_CONN_ERR;
+        http_conn_close(conn);
+        return;
+    }
+
+    /* headers are out, the rest of the value comes as fast as the client reads */
+    if (conn->stream && conn->stream->streaming) {
+        http_conn_timer_set(conn, HTTP_TIMER_REDIS, redis_timeout_ms);
+        return;
+    }
+
+    /* answer everything still waiting for redis with 504, late replies are dropped */
+    ngx_queue_t* q;
+    for (q = ngx_queue_head(&conn->requests);
+            q != ngx_queue_sentinel(&conn->requests); q = ngx_queue_next(q)) {
+        http_req_t* req = ngx_queue_data(q, http_req_t, queue);
+        if (req->flags & HTTP_REQ_DONE) continue;
+
+        if (conn->stream && conn->stream->req == req) {
+            redis_stream_abort(conn->stream);
+        }
+        else if (req->upload && req->upload->state < REDIS_UPLOAD_COMMIT) {
+            /* the half sent command goes with its redis connection */
+            redis_upload_abort(req->upload);
+        }
+        else {
+            if (req->flight) redis_flight_remove_req(req->flight, req);
+            if (req->mget) req->mget->req = NULL;
+            if (req->range) req->range->req = NULL;
+            if (req->hash) req->hash->req = NULL;
+            if (req->upload) {
+                req->upload->req = NULL;
+                conn->upload = NULL;
+            }
+            conn->waiting--;
+        }
+
+        http_req_set_error(req, HTTP_STATUS_GATEWAY_TIMEOUT);
+    }
+
+    conn->flags = conn->flags | HTTP_CONN_LAST;
+    http_conn_flush(conn);
+}
+
+static void http_wheel_cb(EV_P_ ev_timer* w, int revents) {
+    http_server_t* server = (http_server_t*)
+        (((char*)w) - offsetof(http_server_t, wheel_timer));
+    unsigned long now = http_wheel_now(server);
+    unsigned long t, n;
+
+    for (t = server->wheel_tick + 1, n = 0; t <= now && n < HTTP_WHEEL_SLOTS; t++, n++) {
+        ngx_queue_t* slot = &server->wheel[t & (HTTP_WHEEL_SLOTS - 1)];
+        ngx_queue_t expired;
+        ngx_queue_init(&expired);
+
+        /* later rounds stay in the slot */
+        ngx_queue_t* q = ngx_queue_head(slot);
+        while (q != ngx_queue_sentinel(slot)) {
+            ngx_queue_t* next = ngx_queue_next(q);
+            http_conn_t* conn = ngx_queue_data(q, http_conn_t, timer);
+            if (conn->timer_expires <= now) {
+                ngx_queue_remove(q);
+                ngx_queue_insert_tail(&expired, q);
+            }
+            q = next;
+        }
+
+        /* each timeout takes its conn off the list, and may close others */
+        while (!ngx_queue_empty(&expired)) {
+            http_conn_timeout(ngx_queue_data(ngx_queue_head(&expired), http_conn_t, timer));
+        }
+    }
+    server->wheel_tick = now;
+}
+
+static size_t http_conn_stride(void) {
+    return (sizeof(http_conn_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+}
+
+static void http_conn_slab_alloc(http_server_t* server, size_t n) {
+    size_t stride = http_conn_stride();
+    char* p;
+    size_t i;
+
+    if (posix_memalign((void**)&p, CACHE_LINE_SIZE, CACHE_LINE_SIZE + n * stride)) {
+        fprintf(stderr, "failed to allocate connections\n");
+        abort();
+    }
+
+    http_conn_slab_t* slab = (http_conn_slab_t*)p;
+    slab->next = server->conn_slabs;
+    server->conn_slabs = slab;
+
+    for (i = 0; i < n; i++) {
+        http_conn_t* conn = (http_conn_t*)(p + CACHE_LINE_SIZE + i * stride);
+        conn->rbuf = buffer_init();
+        buffer_prepare_append(conn->rbuf, HTTP_CONN_READ_MIN);
+        ngx_queue_insert_tail(&server->conn_pool, &conn->queue);
+    }
+}
+
+static http_server_t* http_server_init(struct ev_loop* loop) {
+    http_server_t* server = malloc(sizeof(http_server_t));
+    assert(server);
+
+    server->loop = loop;
+    server->listens  = NULL;
+    server->nlistens = 0;
+    server->closing  = 0;
+    http_date_init(&server->date);
+    server->unique = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid() << 8 ^ (uintptr_t)server;
+    ngx_queue_init(&server->connections);
+    server->nconns = 0;
+    server->accept_paused = 0;
+
+    ngx_queue_init(&server->conn_pool);
+    server->conn_slabs = NULL;
+
+    server->wheel = malloc(sizeof(ngx_queue_t) * HTTP_WHEEL_SLOTS);
+    assert(server->wheel);
+    unsigned long slot;
+    for (slot = 0; slot < HTTP_WHEEL_SLOTS; slot++) {
+        ngx_queue_init(&server->wheel[slot]);
+    }
+    server->wheel_tick  = 0;
+    server->wheel_epoch = ev_now(loop);
+    server->ntimers     = 0;
+    ev_init(&server->wheel_timer, http_wheel_cb);
+    server->wheel_timer.repeat = HTTP_WHEEL_TICK;
+    if (http_max_connections > 0) {
+        http_conn_slab_alloc(server, http_max_connections);
+    }
+
+    server->nredis = redis_connections > 0 ? redis_connections : 1;
+    server->redis  = calloc(server->nredis, sizeof(redis_conn_t));
+    assert(server->redis);
+
+    int i;
+    for (i = 0; i < server->nredis; i++) {
+        server->redis[i].server = server;
+        ev_timer_init(&server->redis[i].reconnect_timer, redis_reconnect_cb, 2., 0.);
+    }
+
+    server->batch = NULL;
+    ev_prepare_init(&server->batch_prepare, redis_batch_prepare_cb);
+
+    ngx_queue_init(&server->deferred);
+    ev_prepare_init(&server->write_prepare, http_conn_write_prepare_cb);
+    ev_timer_init(&server->batch_timer, redis_batch_timer_cb, 0., 0.);
+
+    server->flights_size = REDIS_FLIGHTS_INITIAL;
+    server->flights = calloc(server->flights_size, sizeof(redis_flight_t*));
+    assert(server->flights);
+    server->nflights = 0;
+
+    cache_init(&server->cache);
+    server->cache_generation = 0;
+
+    memset(&server->tracking, 0, sizeof(redis_conn_t));
+    server->tracking.server = server;
+    ev_timer_init(&server->tracking.reconnect_timer, redis_reconnect_cb, 2., 0.);
+    server->tracking_id = 0;
+
+    ngx_queue_init(&server->streams_idle);
+    server->nstreams = 0;
+    ngx_queue_init(&server->uploads_idle);
+    server->nuploads = 0;
+    server->stream_hints = calloc(REDIS_STREAM_HINTS, sizeof(redis_stream_hint_t));
+    assert(server->stream_hints);
+
+    /* shutdown notification, must not keep the loop alive by itself */
+    ev_async_init(&server->stop_async, sigterm_cb);
+    server->stop_async.data = (void*)server;
+    ev_async_start(loop, &server->stop_async);
+    ev_unref(loop);
+
+    return server;
+}
+
+static void http_server_free(http_server_t* server) {
+    size_t i;
+    for (i = 0; i < REDIS_STREAM_HINTS; i++) {
+        if (server->stream_hints[i].key) sdsfree(server->stream_hints[i].key);
+    }
+    free(server->stream_hints);
+    free(server->wheel);
+
+    while (!ngx_queue_empty(&server->conn_pool)) {
+        http_conn_t* conn = ngx_queue_data(ngx_queue_head(&server->conn_pool),
+            http_conn_t, queue);
+        ngx_queue_remove(&conn->queue);
+        buffer_free(conn->rbuf);
+    }
+    while (server->conn_slabs) {
+        http_conn_slab_t* slab = server->conn_slabs;
+        server->conn_slabs = slab->next;
+        free(slab);
+    }
+
+    cache_free(&server->cache);
+    free(server->flights);
+    free(server->redis);
+    free(server->listens);
+    free(server);
+}
+
+static http_conn_t* http_conn_init(http_server_t* server, int fd) {
+    if (ngx_queue_empty(&server->conn_pool)) {
+        http_conn_slab_alloc(server, HTTP_CONN_SLAB);
+    }
+
+    ngx_queue_t* q = ngx_queue_head(&server->conn_pool);
+    ngx_queue_remove(q);
+    http_conn_t* conn = ngx_queue_data(q, http_conn_t, queue);
+
+    conn->fd = fd;
+    ngx_queue_init(&conn->queue);
+    conn->server = server;
+    conn->stream = NULL;
+    conn->upload = NULL;
+    conn->last_len = 0;
+    conn->flags = 0;
+
+    ngx_queue_init(&conn->timer);
+    conn->timer_phase = HTTP_TIMER_NONE;
+
+    ngx_queue_init(&conn->requests);
+    conn->nrequests = 0;
+    conn->waiting   = 0;
+
+    ngx_queue_init(&conn->output);
+    conn->output_size = 0;
+
+    return conn;
+}
+
+/* hand finished responses from the head of the request queue to the socket */
+static void http_conn_flush(http_conn_t* conn) {
+    if (conn->stream) {
+        redis_stream_resume(conn->stream);
+    }
+
+    while (!(conn->flags & (HTTP_CONN_ERR | HTTP_CONN_CLOSE)) &&
+           !ngx_queue_empty(&conn->requests)) {
+        http_req_t* req = ngx_queue_data(ngx_queue_head(&conn->requests),
+            http_req_t, queue);
+        if (!(req->flags & HTTP_REQ_DONE)) break;
+
+        if (req->resp) {
+            http_conn_write_buffer(conn, req->resp);
+            req->resp = NULL;
+        }
+
+        if (!(req->flags & HTTP_REQ_KEEPALIVE)) {
+            conn->flags = conn->flags | HTTP_CONN_CLOSE;
+        }
+        http_req_free(req);
+    }
+
+    if (conn->flags & HTTP_CONN_ERR) {
+        http_conn_close(conn);
+        return;
+    }
+
+    /* every request has been answered */
+    if (ngx_queue_empty(&conn->requests) &&
+            (conn->flags & HTTP_CONN_LAST || conn->server->closing)) {
+        conn->flags = conn->flags | HTTP_CONN_CLOSE;
+    }
+
+    if (conn->flags & HTTP_CONN_CLOSE) {
+        /* otherwise closed by http_conn_write_cb once drained */
+        if (0 == conn->output_size) {
+            http_conn_close(conn);
+        }
+        return;
+    }
+
+    http_conn_timer_update(conn);
+
+    if (!http_conn_readable(conn)) return;
+    ev_io_start(conn->server->loop, &conn->ev_read);
+
+    /* requests held back while paused, may close conn */
+    if (conn->rbuf->used) {
+        http_conn_parse(conn);
+    }
+}
+
+static void http_conn_close(http_conn_t* conn) {
+    ev_io_stop(conn->server->loop, &conn->ev_read);
+    ev_io_stop(conn->server->loop, &conn->ev_write);
+
+    if (conn->stream) {
+        redis_stream_abort(conn->stream);
+    }
+    if (conn->upload && conn->upload->state < REDIS_UPLOAD_COMMIT) {
+        redis_upload_abort(conn->upload);
+    }
+
+    /* freed when the last redis reply comes back */
+    conn->flags = conn->flags | HTTP_CONN_ERR;
+    if (conn->waiting) return;
+#ifdef DEBUG
+    fprintf(stderr, "close conn: %d\n", conn->fd);
+#endif
+
+    http_server_t* server = conn->server;
+
+    while (!ngx_queue_empty(&conn->requests)) {
+        http_req_free(ngx_queue_data(ngx_queue_head(&conn->requests),
+            http_req_t, queue));
+    }
+    while (!ngx_queue_empty(&conn->output)) {
+        http_chunk_free(ngx_queue_data(ngx_queue_head(&conn->output),
+            http_chunk_t, queue));
+    }
+
+    http_conn_timer_set(conn, HTTP_TIMER_NONE, 0);
+    if (conn->flags & HTTP_CONN_DEFERRED) {
+        ngx_queue_remove(&conn->deferred);
+    }
+    ngx_queue_remove(&conn->queue);
+    server->nconns--;
+    close(conn->fd);
+
+    /* back to the pool, keeping a read buffer of reasonable size */
+    if (conn->rbuf->size > HTTP_CONN_RBUF_KEEP) {
+        free(conn->rbuf->ptr);
+        conn->rbuf->ptr  = NULL;
+        conn->rbuf->size = 0;
+        buffer_prepare_append(conn->rbuf, HTTP_CONN_READ_MIN);
+    }
+    conn->rbuf->used = 0;
+    ngx_queue_insert_head(&server->conn_pool, &conn->queue);
+
+    if (server->closing && ngx_queue_empty(&server->connections)) {
+        http_server_stop(server);
+    }
+    else if (server->accept_paused && !server->closing) {
+        http_server_accept_resume(server);
+    }
+}
+
+static void http_server_stop(http_server_t* server) {
+    fprintf(stderr, "stopping server\n");
+
+    ev_prepare_stop(server->loop, &server->batch_prepare);
+    ev_timer_stop(server->loop, &server->batch_timer);
+    ev_prepare_stop(server->loop, &server->write_prepare);
+
+    int i;
+    for (i = 0; i < server->nredis; i++) {
+        redis_conn_t* rc = &server->redis[i];
+        if (rc->context) {
+            redisAsyncFree(rc->context);
+        }
+        ev_timer_stop(server->loop, &rc->reconnect_timer);
+    }
+
+    if (server->tracking.context) {
+        redisAsyncFree(server->tracking.context);
+    }
+
+    while (!ngx_queue_empty(&server->streams_idle)) {
+        redis_stream_free(ngx_queue_data(ngx_queue_head(&server->streams_idle),
+            redis_stream_t, queue));
+    }
+    while (!ngx_queue_empty(&server->uploads_idle)) {
+        redis_upload_free(ngx_queue_data(ngx_queue_head(&server->uploads_idle),
+            redis_upload_t, queue));
+    }
+    ev_timer_stop(server->loop, &server->tracking.reconnect_timer);
+
+    for (i = 0; i < server->nlistens; i++) {
+        http_listen_t* ls = &server->listens[i];
+        ev_io_stop(server->loop, &ls->ev_read);
+
+        /* shared sockets stay open for the other loops */
+        if (ls->fd != ls->listener->fd) close(ls->fd);
+    }
+
+    ev_ref(server->loop);
+    ev_async_stop(server->loop, &server->stop_async);
+}
+
+static http_listener_t* http_listener_new(const char* name, size_t name_len) {
+    http_listeners = realloc(http_listeners, sizeof(http_listener_t) * (http_nlisteners + 1));
+    assert(http_listeners);
+
+    http_listener_t* l = &http_listeners[http_nlisteners++];
+    memset(l, 0, sizeof(*l));
+    l->name = sdsnewlen(name, name_len);
+    l->fd   = -1;
+
+    return l;
+}
+
+static void http_listeners_free(void) {
+    int i;
+    for (i = 0; i < http_nlisteners; i++) {
+        sdsfree(http_listeners[i].name);
+    }
+    free(http_listeners);
+    http_listeners  = NULL;
+    http_nlisteners = 0;
+}
+
+/* ADDRESS:PORT, [IPV6]:PORT, PORT, unix:PATH or /PATH */
+static int http_listener_resolve(http_listener_t* l) {
+    const char* name = l->name;
+
+    if (0 == strncmp(name, "unix:", 5) || '/' == name[0]) {
+        struct sockaddr_un* addr = (struct sockaddr_un*)&l->addr;
+        const char* path = '/' == name[0] ? name : name + 5;
+        if (0 == strlen(path) || strlen(path) >= sizeof(addr->sun_path)) {
+            fprintf(stderr, "Invalid listen address %s: bad socket path\n", name);
+            return -1;
+        }
+
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, path);
+        l->addr_len = sizeof(*addr);
+        return 0;
+    }
+
+    sds host;
+    const char* port = strrchr(name, ':');
+    if (NULL == port) {
+        host = sdsnew("0.0.0.0");
+        port = name;
+    }
+    else {
+        host = sdsnewlen(name, port - name);
+        port++;
+        if (sdslen(host) >= 2 && '[' == host[0] && ']' == host[sdslen(host) - 1]) {
+            sdsrange(host, 1, -2);
+        }
+        if (0 == sdslen(host) || 0 == strcmp(host, "*")) {
+            sdsfree(host);
+            host = sdsnew("0.0.0.0");
+        }
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+
+    int r = getaddrinfo(host, port, &hints, &res);
+    sdsfree(host);
+    if (r) {
+        fprintf(stderr, "Invalid listen address %s: %s\n", name, gai_strerror(r));
+        return -1;
+    }
+
+    memcpy(&l->addr, res->ai_addr, res->ai_addrlen);
+    l->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/* --listen ADDRESS[,backlog=N][,defer-accept=SEC][,fastopen=N][,rcvbuf=BYTES][,sndbuf=BYTES] */
+static int http_listener_add(const char* spec) {
+    const char* opts = strchr(spec, ',');
+    size_t name_len  = opts ? (size_t)(opts - spec) : strlen(spec);
+
+    http_listener_t* l = http_listener_new(spec, name_len);
+    if (http_listener_resolve(l)) return -1;
+
+    while (opts) {
+        const char* opt = opts + 1;
+        opts = strchr(opt, ',');
+        size_t opt_len = opts ? (size_t)(opts - opt) : strlen(opt);
+
+        const char* eq = memchr(opt, '=', opt_len);
+        if (NULL == eq) {
+            fprintf(stderr, "Invalid listen option: %.*s\n", (int)opt_len, opt);
+            return -1;
+        }
+        size_t key_len = eq - opt;
+        int value      = atoi(eq + 1);
+
+#define LISTEN_OPTION(n) (sizeof(n) - 1 == key_len && 0 == strncmp(opt, n, key_len))
+        if (LISTEN_OPTION("backlog")) {
+            l->backlog = value;
+        }
+        else if (LISTEN_OPTION("defer-accept")) {
+            l->defer_accept = value;
+        }
+        else if (LISTEN_OPTION("fastopen")) {
+            l->fastopen = value;
+        }
+        else if (LISTEN_OPTION("rcvbuf")) {
+            l->rcvbuf = value;
+        }
+        else if (LISTEN_OPTION("sndbuf")) {
+            l->sndbuf = value;
+        }
+        else {
+            fprintf(stderr, "Unknown listen option: %.*s\n", (int)opt_len, opt);
+            return -1;
+        }
+#undef LISTEN_OPTION
+    }
+
+    return 0;
+}
+
+/*
+ * Listening sockets passed down by start_server replace the configured
+ * ones. A --listen with the same address keeps its options.
+ */
+static void http_listen_inherited(void) {
+    sds ports = sdsnew(getenv("SERVER_STARTER_PORT"));
+    if (0 == sdslen(ports)) {
+        sdsfree(ports);
+        return;
+    }
+
+    int configured = http_nlisteners;
+    int count, pair_count, i, j;
+    sds* pairs = sdssplitlen(ports, sdslen(ports), ";", 1, &count);
+    for (i = 0; i < count; i++) {
+        sds* port_fd = sdssplitlen(pairs[i], sdslen(pairs[i]), "=", 1, &pair_count);
+        if (pair_count < 2) {
+            sdsfreesplitres(port_fd, pair_count);
+            continue;
+        }
 
-static void redis_reconnect_cb(EV_P_ ev_timer* w, int revents) {
-    ev_timer_stop(EV_A_ w);
+        http_listener_t* l = NULL;
+        for (j = 0; j < configured; j++) {
+            if (-1 == http_listeners[j].fd && 0 == strcmp(http_listeners[j].name, port_fd[0])) {
+                l = &http_listeners[j];
+                break;
+            }
+        }
+        if (NULL == l) {
+            l = http_listener_new(port_fd[0], sdslen(port_fd[0]));
+        }
 
-    http_server_t* server = (http_server_t*)
-        (((char*)w) - offsetof(http_server_t, reconnect_timer));
+        l->fd = atoi(port_fd[1]);
+        l->addr_len = sizeof(l->addr);
+        getsockname(l->fd, (struct sockaddr*)&l->addr, &l->addr_len);
 
-    redisAsyncContext* c = redis_connect();
-    if (c) {
-        c->data = (void*)server;
-    }
-    else {
-        redis_reconnect(server);
+        sdsfreesplitres(port_fd, pair_count);
     }
-}
+    sdsfreesplitres(pairs, count);
+    sdsfree(ports);
 
-static void redis_reconnect(http_server_t* server) {
-    ev_timer_set(&server->reconnect_timer, 2., 0.);
-    ev_timer_start(EV_DEFAULT_ &server->reconnect_timer);
+    /* drop configured listeners start_server did not pass */
+    for (i = 0, j = 0; i < http_nlisteners; i++) {
+        if (-1 == http_listeners[i].fd) {
+            sdsfree(http_listeners[i].name);
+            continue;
+        }
+        http_listeners[j++] = http_listeners[i];
+    }
+    http_nlisteners = j;
 }
 
-static void redis_connect_cb(const redisAsyncContext* c, int status) {
-    http_server_t* server = (http_server_t*)c->data;
+static int http_listener_bind(http_listener_t* l, int reuseport) {
+    int family = l->addr.ss_family;
+    int listen_sock, r, flag = 1;
 
-    if (status != REDIS_OK) {
-        fprintf(stderr, "redis connect error: %s\n", c->errstr);
-        redis_reconnect(server);
-        return;
+    listen_sock = socket(family, SOCK_STREAM, 0);
+    if (-1 == listen_sock) {
+        fprintf(stderr, "socket failed for %s: %d, %s\n", l->name, errno, strerror(errno));
+        return -1;
     }
-    printf("Connected redis-server (%s:%d)\n", redis_address, redis_port);
 
-    server->data = (void*)c;
-}
+    r = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    assert(0 == r);
 
-static void redis_disconnect_cb(const redisAsyncContext* c, int status) {
-    if (status != REDIS_OK) {
-        fprintf(stderr, "redis error: %d %s\n", status, c->errstr);
+    if (AF_UNIX == family) {
+        unlink(((struct sockaddr_un*)&l->addr)->sun_path);
     }
     else {
-        fprintf(stderr, "disconnected from redis\n");
+#ifdef SO_REUSEPORT
+        /* every worker binds its own socket, the kernel spreads connections */
+        if (reuseport) {
+            r = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+            assert(0 == r);
+        }
+#endif
+#ifdef IPV6_V6ONLY
+        /* so [::]:PORT can be listened on next to 0.0.0.0:PORT */
+        if (AF_INET6 == family) {
+            setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+        }
+#endif
     }
 
-    http_server_t* server = (http_server_t*)c->data;
-    server->data = NULL;
+    r = bind(listen_sock, (struct sockaddr*)&l->addr, l->addr_len);
+    if (r) {
+        fprintf(stderr, "bind failed for %s: %d, %s\n", l->name, errno, strerror(errno));
+        close(listen_sock);
+        return -1;
+    }
 
-    if (0 == server->closing)
-        redis_reconnect(server);
+    return listen_sock;
 }
 
-static void redis_data_cb(redisAsyncContext* c, void* r, void* privdata) {
-    redisReply* reply = r;
-    http_conn_t* conn = (http_conn_t*)privdata;
+/* bind unless already bound or inherited, apply the listener's options and listen */
+static int http_listener_open(http_listener_t* l, int reuseport) {
+    int listen_sock = -1 == l->fd ? http_listener_bind(l, reuseport) : l->fd;
+    int tcp = AF_UNIX != l->addr.ss_family;
+    int r;
 
-    conn->flags = conn->flags ^ HTTP_CONN_WAIT_REDIS;
+    if (-1 == listen_sock) return -1;
 
-    if (conn->flags & HTTP_CONN_ERR) {
-        http_conn_close(conn);
-        return;
+    /* before listen(2) so the window scale of accepted sockets matches */
+    if (l->rcvbuf) {
+        setsockopt(listen_sock, SOL_SOCKET, SO_RCVBUF, &l->rcvbuf, sizeof(l->rcvbuf));
     }
-
-    if (reply == NULL) {
-        return;
+    if (l->sndbuf) {
+        setsockopt(listen_sock, SOL_SOCKET, SO_SNDBUF, &l->sndbuf, sizeof(l->sndbuf));
     }
 
-    if (conn == NULL) {
-        fprintf(stderr, "invalid privdata\n");
-        return;
+    if (tcp && l->defer_accept) {
+#ifdef TCP_DEFER_ACCEPT
+        /* wake up only once the request has arrived */
+        r = setsockopt(listen_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+            &l->defer_accept, sizeof(l->defer_accept));
+        if (r) fprintf(stderr, "TCP_DEFER_ACCEPT failed for %s: %s\n", l->name, strerror(errno));
+#else
+        fprintf(stderr, "defer-accept is not supported here, ignored for %s\n", l->name);
+#endif
+    }
+    if (tcp && l->fastopen) {
+#ifdef TCP_FASTOPEN
+        r = setsockopt(listen_sock, IPPROTO_TCP, TCP_FASTOPEN,
+            &l->fastopen, sizeof(l->fastopen));
+        if (r) fprintf(stderr, "TCP_FASTOPEN failed for %s: %s\n", l->name, strerror(errno));
+#else
+        fprintf(stderr, "fastopen is not supported here, ignored for %s\n", l->name);
+#endif
     }
 
-    if (0 == reply->len) {
-        write(conn->fd, NOT_FOUND, NOT_FOUND_LEN);
+    r = listen(listen_sock, l->backlog ? l->backlog : http_backlog);
+    if (r) {
+        fprintf(stderr, "listen failed for %s: %d, %s\n", l->name, errno, strerror(errno));
+        if (-1 == l->fd) close(listen_sock);
+        return -1;
     }
-    else {
-        struct iovec v[3];
-        v[0].iov_base = (char*)OK_HDR;
-        v[0].iov_len  = OK_HDR_LEN;
 
-        char content_length[64];
-        snprintf(content_length, 64, "Content-Length: %d\r\n\r\n", reply->len);
-        v[1].iov_base = content_length;
-        v[1].iov_len  = strlen(content_length);
+    setup_sock(listen_sock, tcp);
+
+    return listen_sock;
+}
+
+static int http_server_listen(http_server_t* server) {
+    server->listens = calloc(http_nlisteners, sizeof(http_listen_t));
+    assert(server->listens);
+
+    int i;
+    for (i = 0; i < http_nlisteners; i++) {
+        http_listener_t* l = &http_listeners[i];
+        http_listen_t* ls  = &server->listens[i];
 
-        v[2].iov_base = reply->str;
-        v[2].iov_len  = reply->len;
+        ls->fd = -1 != l->fd ? l->fd : http_listener_open(l, 1);
+        if (-1 == ls->fd) return -1;
+        ls->listener = l;
+        ls->server   = server;
+        server->nlistens++;
 
-        writev(conn->fd, v, 3);
+        ev_io_init(&ls->ev_read, http_acccept_cb, ls->fd, EV_READ);
+        ev_io_start(server->loop, &ls->ev_read);
     }
-    http_conn_close(conn);
+
+    return 0;
 }
 
-static void setup_sock(int fd) {
-    int on = 1, r;
+/* --max-connections: stop watching the listening sockets while at the limit */
+static void http_server_accept_pause(http_server_t* server) {
+    int i;
+    for (i = 0; i < server->nlistens; i++) {
+        ev_io_stop(server->loop, &server->listens[i].ev_read);
+    }
+    server->accept_paused = 1;
+}
 
-    if (NULL == http_socket) {
-        r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
-        assert(r == 0);
+static void http_server_accept_resume(http_server_t* server) {
+    int i;
+    for (i = 0; i < server->nlistens; i++) {
+        ev_io_start(server->loop, &server->listens[i].ev_read);
     }
-    r = fcntl(fd, F_SETFL, O_NONBLOCK);
-    assert(r == 0);
+    server->accept_paused = 0;
 }
 
-static void http_conn_read_cb(EV_P_ ev_io* w, int revents) {
-    http_conn_t* conn = (http_conn_t*)
-        (((char*)w) - offsetof(http_conn_t, ev_read));
-    //http_server_t* server = conn->server;
+static void sigterm_cb(EV_P_ ev_async* w, int revents) {
+    http_server_t* s = (http_server_t*)w->data;
+    s->closing = 1;
 
-    char buf[1024];
-    ssize_t r = read(w->fd, buf, 1024);
+    /* leave new connections to the next generation or other workers */
+    int i;
+    for (i = 0; i < s->nlistens; i++) {
+        ev_io_stop(EV_A_ &s->listens[i].ev_read);
+    }
 
-    if (0 == r) {
-        /* connection closed by peer */
-#ifdef DEBUG
-        fprintf(stderr, "connection closed by peer: %d\n", w->fd);
-#endif
-        conn->flags = conn->flags | HTTP_CONN_ERR;
-        http_conn_close(conn);
+    if (ngx_queue_empty(&s->connections)) {
+        http_server_stop(s);
         return;
     }
-    else if (-1 == r) {
-        /* error */
-        if (EAGAIN == errno || EWOULDBLOCK == errno) { /* try again later */
-            return;
-        }
-        else { /* fatal error */
-#ifdef DEBUG
-            fprintf(stderr, "fatal error: %d, %s\n", errno, strerror(errno));
-#endif
-            conn->flags = conn->flags | HTTP_CONN_ERR;
+
+    /* idle keep-alive connections would otherwise hold the server open */
+    ngx_queue_t* q = ngx_queue_head(&s->connections);
+    while (q != ngx_queue_sentinel(&s->connections)) {
+        http_conn_t* conn = ngx_queue_data(q, http_conn_t, queue);
+        q = ngx_queue_next(q);
+
+        if (ngx_queue_empty(&conn->requests) && 0 == conn->rbuf->used &&
+                0 == conn->output_size) {
             http_conn_close(conn);
-            return;
         }
     }
-    else { /* got some data */
-        buffer_append_string_len(conn->rbuf, buf, r);
+}
 
-        const char* method;
-        const char* path;
-        size_t method_len, path_len;
-        int minor_version;
-        size_t num_headers = 20;
-        struct phr_header headers[num_headers];
+static void sigtermHandler(int sig) {
+    printf("Received SIGTERM, scheduling shutdown...\n");
+
+    /* each loop shuts its own server down, see sigterm_cb */
+    int i;
+    for (i = 0; i < http_nservers; i++) {
+        ev_async_send(http_servers[i]->loop, &http_servers[i]->stop_async);
+    }
+}
 
-        r = phr_parse_request(conn->rbuf->ptr, conn->rbuf->used, &method, &method_len,
-            &path, &path_len, &minor_version, headers, &num_headers, 0);
+static void* http_server_thread(void* arg) {
+    http_server_t* server = (http_server_t*)arg;
 
-        if (r >= 0) {
-            if (0 == strncmp(method, "GET", method_len) && path_len > 1) {
-                redisAsyncContext* c = (redisAsyncContext*)conn->server->data;
-                if (c) {
-                    redisAsyncCommand(c, redis_data_cb, conn, "GET %b", path + 1, path_len - 1);
-                    conn->flags = conn->flags | HTTP_CONN_WAIT_REDIS;
-                }
-                else {
-                    write(conn->fd, BAD_GATEWAY, BAD_GATEWAY_LEN);
-                    conn->flags = conn->flags | HTTP_CONN_ERR;
-                    http_conn_close(conn);
-                }
-            }
-            else {
-                write(conn->fd, BAD_REQUEST, BAD_REQUEST_LEN);
-                conn->flags = conn->flags | HTTP_CONN_ERR;
-                http_conn_close(conn);
+    ev_loop(server->loop, 0);
+
+    return NULL;
+}
+
+/*
+ * Run one server per --threads, each with its own event loop, redis
+ * connection and listening sockets (except the shared ones).
+ * The calling thread runs the first one on the default loop.
+ */
+static int run_server(void) {
+    int i, r = 0;
+
+    http_nservers = http_threads > 1 ? http_threads : 1;
+    http_servers  = calloc(http_nservers, sizeof(http_server_t*));
+    assert(http_servers);
+
+    for (i = 0; i < http_nservers; i++) {
+        struct ev_loop* loop = 0 == i ? EV_DEFAULT : ev_loop_new(EVFLAG_AUTO);
+        assert(loop);
+
+        http_server_t* server = http_server_init(loop);
+        assert(server);
+        http_servers[i] = server;
+
+        /* redis clients */
+        int j;
+        for (j = 0; j < server->nredis; j++) {
+            server->redis[j].context = redis_connect(&server->redis[j]);
+            if (NULL == server->redis[j].context) {
+                return -1;
             }
         }
-        else if (-2 == r) {
-            /* partial */
-            return;
+        if (cache_tracking) {
+            server->tracking.context = redis_connect(&server->tracking);
+            if (NULL == server->tracking.context) {
+                return -1;
+            }
         }
-        else if (-1 == r) {
-            write(conn->fd, BAD_REQUEST, BAD_REQUEST_LEN);
-            conn->flags = conn->flags | HTTP_CONN_ERR;
-            http_conn_close(conn);
+
+        if (http_server_listen(server)) {
+            return -1;
         }
     }
-}
 
-static void http_acccept_cb(EV_P_ ev_io* w, int revents) {
-    int newfd = accept(w->fd, NULL, NULL);
-    if (0 >= newfd) {
-        fprintf(stderr, "accept failed: %d, %s\n", errno, strerror(errno));
-        return;
-    }
+    struct sigaction act;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = sigtermHandler;
+    sigaction(SIGTERM, &act, NULL);
 
-    setup_sock(newfd);
+    /* a worker is forked with SIGTERM blocked, see spawn_worker */
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &term, NULL);
 
-    http_server_t* server = (http_server_t*)
-        (((char*)w) - offsetof(http_server_t, ev_read));
+    for (i = 1; i < http_nservers; i++) {
+        r = pthread_create(&http_servers[i]->thread, NULL,
+            http_server_thread, http_servers[i]);
+        assert(0 == r);
+    }
 
-    http_conn_t* conn = http_conn_init(newfd);
-    ngx_queue_insert_tail(&server->connections, &conn->queue);
-    conn->server = server;
+    /* main loop */
+    ev_loop(http_servers[0]->loop, 0);
 
-    ev_io_init(&conn->ev_read, http_conn_read_cb, newfd, EV_READ);
-    ev_io_start(EV_A_ &conn->ev_read);
+    for (i = 1; i < http_nservers; i++) {
+        pthread_join(http_servers[i]->thread, NULL);
+        ev_loop_destroy(http_servers[i]->loop);
+    }
+    for (i = 0; i < http_nservers; i++) {
+        http_server_free(http_servers[i]);
+    }
+    free(http_servers);
 
-#ifdef DEBUG
-    fprintf(stderr, "new connection: %d\n", newfd);
-#endif
+    return 0;
 }
 
-static http_server_t* http_server_init() {
-    http_server_t* server = malloc(sizeof(http_server_t));
-    assert(server);
-
-    server->fd = 0;
-    server->closing = 0;
-    ngx_queue_init(&server->connections);
-
-    ev_timer_init(&server->reconnect_timer, redis_reconnect_cb, 2., 0.);
+/* --workers mode: the master only forks, watches and respawns workers */
+static pid_t* worker_pids;
+static time_t* worker_started;
+static volatile sig_atomic_t master_terminating;
 
-    return server;
+static void masterSigtermHandler(int sig) {
+    master_terminating = 1;
 }
 
-static void http_server_free(http_server_t* server) {
-    free(server);
+static void masterSigchldHandler(int sig) {
+    /* only here to interrupt sigsuspend */
 }
 
-static http_conn_t* http_conn_init(int fd) {
-    http_conn_t* conn = malloc(sizeof(http_conn_t));
-    assert(conn);
+static pid_t spawn_worker(const sigset_t* mask) {
+    fflush(stdout);
+    fflush(stderr);
 
-    conn->fd = fd;
-    ngx_queue_init(&conn->queue);
-    conn->rbuf  = buffer_init();
-    conn->flags = 0;
+    pid_t pid = fork();
+    if (-1 == pid) {
+        fprintf(stderr, "fork failed: %d, %s\n", errno, strerror(errno));
+        return -1;
+    }
+    if (0 == pid) {
+        signal(SIGCHLD, SIG_DFL);
 
-    return conn;
-}
+        /* SIGTERM stays blocked until run_server installed its handler */
+        sigset_t worker_mask = *mask;
+        sigaddset(&worker_mask, SIGTERM);
+        sigprocmask(SIG_SETMASK, &worker_mask, NULL);
 
-static void http_conn_close(http_conn_t* conn) {
-    ev_io_stop(EV_DEFAULT_ &conn->ev_read);
+        exit(run_server());
+    }
+    return pid;
+}
 
-    if (conn->flags & HTTP_CONN_WAIT_REDIS) return;
-#ifdef DEBUG
-    fprintf(stderr, "close conn: %d\n", conn->fd);
-#endif
+static int run_master(void) {
+    sigset_t block, orig;
+    struct sigaction act;
+    int i, failed = 0;
 
-    http_server_t* server = conn->server;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = masterSigtermHandler;
+    sigaction(SIGTERM, &act, NULL);
+    act.sa_handler = masterSigchldHandler;
+    sigaction(SIGCHLD, &act, NULL);
 
-    ngx_queue_remove(&conn->queue);
-    close(conn->fd);
-    buffer_free(conn->rbuf);
-    free(conn);
+    /* signals are only delivered inside sigsuspend, so none gets lost */
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &orig);
 
-    if (server->closing && ngx_queue_empty(&server->connections)) {
-        /* stop server */
-        fprintf(stderr, "stopping server\n");
-        redisAsyncContext* c = (redisAsyncContext*)server->data;
-        if (c) {
-            redisAsyncFree(c);
-        }
+    worker_pids    = calloc(http_workers, sizeof(pid_t));
+    worker_started = calloc(http_workers, sizeof(time_t));
+    assert(worker_pids && worker_started);
 
-        ev_io_stop(EV_DEFAULT_ &server->ev_read);
-        ev_timer_stop(EV_DEFAULT_ &server->reconnect_timer);
-        close(server->fd);
+    for (i = 0; i < http_workers; i++) {
+        worker_pids[i]    = spawn_worker(&orig);
+        worker_started[i] = time(NULL);
     }
-}
 
-static void http_server_listen(http_server_t* server) {
-    int listen_sock = 0, r, flag = 1;
+    while (!master_terminating) {
+        int status;
+        pid_t pid;
 
-    sds ports = sdsnew(getenv("SERVER_STARTER_PORT"));
-    if (sdslen(ports)) {
-        int count, pair_count;
-        sds* pairs = sdssplitlen(ports, sdslen(ports), ";", 1, &count);
-        int i;
-        for (i = 0; i < count; i++) {
-            sds* port_fd = sdssplitlen(pairs[i], sdslen(pairs[i]), "=", 1, &pair_count);
-            if (pair_count < 2) {
-                sdsfreesplitres(port_fd, pair_count);
-                continue;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < http_workers; i++) {
+                if (worker_pids[i] == pid) break;
             }
+            if (i == http_workers) continue;
 
-            int host_port_count;
-            sds* host_port = sdssplitlen(port_fd[0], sdslen(port_fd[0]),
-                ":", 1, &host_port_count);
-
-            if (host_port_count >= 2) {
-                sdsfree(http_address);
-                http_address = sdsnew(host_port[ host_port_count - 1 - 1 ]);
-                http_port    = atoi(host_port[ host_port_count - 1 ]);
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "worker %d killed by signal %d\n", pid, WTERMSIG(status));
             }
             else {
-                sdsfree(http_address);
-                http_address = sdsnew("0.0.0.0");
-                http_port    = atoi(port_fd[0]);
-                if (0 == http_port) {
-                    if (http_socket) sdsfree(http_socket);
-                    http_socket = sdsnew(port_fd[0]);
-                }
+                fprintf(stderr, "worker %d exited with status %d\n", pid, WEXITSTATUS(status));
             }
-            sdsfreesplitres(host_port, host_port_count);
-
-            listen_sock = atoi(port_fd[1]);
-
-            sdsfreesplitres(port_fd, pair_count);
-            break;
-        }
-        sdsfreesplitres(pairs, count);
-    }
-    sdsfree(ports);
 
-    if (0 == listen_sock) {
-        if (http_socket) {
-            listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-            assert(-1 != listen_sock);
-
-            r = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-            assert(0 == r);
-
-            struct sockaddr_un listen_addr;
-            memset(&listen_addr, 0, sizeof(listen_addr));
-            strncpy(listen_addr.sun_path, http_socket, sizeof(listen_addr.sun_path) - 1);
-            listen_addr.sun_family = AF_UNIX;
-            unlink(listen_addr.sun_path);
-            r = bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr));
-            if (r) {
-                fprintf(stderr, "bind failed: %d, %s\n", errno, strerror(errno));
+            /* a worker that can't start won't do better next time */
+            if (time(NULL) - worker_started[i] < 1 &&
+                    (WIFSIGNALED(status) || 0 != WEXITSTATUS(status))) {
+                fprintf(stderr, "worker %d failed at startup, exiting\n", pid);
+                worker_pids[i]    = -1;
+                master_terminating = 1;
+                failed = 1;
+                break;
             }
-            assert(0 == r);
-        }
-        else {
-            listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-            assert(-1 != listen_sock);
-
-            r = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-            assert(0 == r);
 
-            struct sockaddr_in listen_addr;
-            listen_addr.sin_family      = AF_INET;
-            listen_addr.sin_port        = htons(http_port);
-            listen_addr.sin_addr.s_addr = 0; /* ANY */
-            r = bind(listen_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr));
-            assert(0 == r);
+            worker_pids[i]    = spawn_worker(&orig);
+            worker_started[i] = time(NULL);
         }
-    }
-
-    r = listen(listen_sock, 128);
-    assert(0 == r);
-
-    setup_sock(listen_sock);
-
-    server->fd = listen_sock;
-    ev_io_init(&server->ev_read, http_acccept_cb, listen_sock, EV_READ);
-    ev_io_start(EV_DEFAULT_ &server->ev_read);
-}
 
-static void sigterm_cb(EV_P_ ev_async* w, int revents) {
-    fprintf(stderr, "here\n");
-    http_server_t* server = (http_server_t*)w->data;
-    server->closing = 1;
-}
+        if (!master_terminating) sigsuspend(&orig);
+    }
 
-static void sigtermHandler(int sig) {
-    printf("Received SIGTERM, scheduling shutdown...\n");
-    http_server_t* s = instance;
-    s->closing = 1;
+    if (!failed) printf("Received SIGTERM, stopping workers...\n");
+    for (i = 0; i < http_workers; i++) {
+        if (worker_pids[i] > 0) kill(worker_pids[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || EINTR == errno);
 
-    if (ngx_queue_empty(&s->connections)) {
-        redisAsyncContext* c = (redisAsyncContext*)s->data;
-        if (c) redisAsyncFree(c);
+    free(worker_pids);
+    free(worker_started);
 
-        ev_io_stop(EV_DEFAULT_ &s->ev_read);
-        close(s->fd);
-    }
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char** argv) {
@@ -498,6 +4749,24 @@ int main(int argc, char** argv) {
     redis_port    = 6379;
     redis_address = sdsnew("127.0.0.1");
     redis_socket  = NULL;
+    http_write_hwm = 1024 * 1024;
+    http_workers  = 0;
+    http_threads  = 1;
+    redis_connections = 1;
+    redis_mget_batch  = 0;
+    redis_mget_window_us = 0;
+    cache_size   = 0;
+    cache_ttl_ms = 1000;
+    cache_tracking = 0;
+    http_max_connections = 0;
+    http_backlog      = 128;
+    http_accept_batch = 64;
+    redis_stream_threshold = 0;
+    http_header_timeout = 30;
+    http_idle_timeout   = 60;
+    redis_timeout_ms    = 0;
+    http_defer_writes   = 0;
+    http_etag           = 0;
 
     if (argc >= 2) {
         int j = 1;
@@ -533,6 +4802,9 @@ int main(int argc, char** argv) {
                 else if (0 == strcmp(option, "socket")) {
                     http_socket = sdsnew(argv[j]);
                 }
+                else if (0 == strcmp(option, "listen")) {
+                    if (http_listener_add(argv[j])) exit(1);
+                }
                 else if (0 == strcmp(option, "redis-port")) {
                     redis_port = atoi(argv[j]);
                 }
@@ -543,6 +4815,60 @@ int main(int argc, char** argv) {
                 else if (0 == strcmp(option, "redis-socket")) {
                     redis_socket = sdsnew(argv[j]);
                 }
+                else if (0 == strcmp(option, "write-hwm")) {
+                    http_write_hwm = strtoul(argv[j], NULL, 10);
+                }
+                else if (0 == strcmp(option, "workers")) {
+                    http_workers = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "threads")) {
+                    http_threads = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "redis-connections")) {
+                    redis_connections = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "mget-batch")) {
+                    redis_mget_batch = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "mget-window-us")) {
+                    redis_mget_window_us = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "cache-size")) {
+                    cache_size = strtoul(argv[j], NULL, 10);
+                }
+                else if (0 == strcmp(option, "cache-ttl-ms")) {
+                    cache_ttl_ms = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "cache-tracking")) {
+                    cache_tracking = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "max-connections")) {
+                    http_max_connections = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "backlog")) {
+                    http_backlog = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "accept-batch")) {
+                    http_accept_batch = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "header-timeout")) {
+                    http_header_timeout = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "idle-timeout")) {
+                    http_idle_timeout = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "redis-timeout-ms")) {
+                    redis_timeout_ms = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "defer-writes")) {
+                    http_defer_writes = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "etag")) {
+                    http_etag = atoi(argv[j]);
+                }
+                else if (0 == strcmp(option, "stream-threshold")) {
+                    redis_stream_threshold = strtoul(argv[j], NULL, 10);
+                }
                 else {
                     fprintf(stderr, "Unknown option: %s\n", option);
                 }
@@ -554,52 +4880,84 @@ int main(int argc, char** argv) {
         }
     }
 
-    /* redis client */
-    redisAsyncContext* c = redis_connect();
-    if (NULL == c) {
-        return -1;
-    }
-
-    /* http server */
-    http_server_t* server = http_server_init();
-    assert(server);
+    if (http_accept_batch < 1) http_accept_batch = 1;
 
-    http_server_listen(server);
+    /* --socket, or --address and --port, unless there is a --listen */
+    if (0 == http_nlisteners) {
+        sds spec;
+        if (http_socket) {
+            spec = sdscatprintf(sdsempty(), "unix:%s", http_socket);
+        }
+        else if (strchr(http_address, ':')) {
+            spec = sdscatprintf(sdsempty(), "[%s]:%d", http_address, http_port);
+        }
+        else {
+            spec = sdscatprintf(sdsempty(), "%s:%d", http_address, http_port);
+        }
+        int r = http_listener_add(spec);
+        sdsfree(spec);
+        if (r) exit(1);
+    }
 
-    c->data = (void*)server;
-    instance = server;
+    http_listen_inherited();
 
-    if (http_socket) {
-        printf("Launched redis-http (unix:%s) ", http_socket);
-    }
-    else {
-        printf("Launched redis-http (%s:%d) ", http_address, http_port);
+    printf("Launched redis-http (");
+    int i;
+    for (i = 0; i < http_nlisteners; i++) {
+        printf("%s%s", i ? ", " : "", http_listeners[i].name);
     }
+    printf(") ");
     if (redis_socket) {
-        printf("proxying redis (unix:%s)\n", redis_socket);
+        printf("proxying redis (unix:%s)", redis_socket);
     }
     else {
-        printf("proxying redis (%s:%d)\n", redis_address, redis_port);
+        printf("proxying redis (%s:%d)", redis_address, redis_port);
     }
+    if (http_workers) {
+        printf(" with %d workers", http_workers);
+    }
+    if (http_threads > 1) {
+        printf(" %s %d threads", http_workers ? "of" : "with", http_threads);
+    }
+    printf("\n");
 
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
-    struct sigaction act;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = sigtermHandler;
-    sigaction(SIGTERM, &act, NULL);
-
-    /* main loop */
-    ev_loop(EV_DEFAULT_ 0);
+    /*
+     * Every worker and thread binds its own SO_REUSEPORT socket for the
+     * listeners left unbound here. SO_REUSEPORT does not balance unix
+     * sockets, so those are shared like the start_server ones.
+     */
+    for (i = 0; i < http_nlisteners; i++) {
+        http_listener_t* l = &http_listeners[i];
+#ifdef SO_REUSEPORT
+        if (-1 == l->fd && AF_UNIX != l->addr.ss_family &&
+                (http_workers || http_threads > 1)) {
+            /* fail here rather than in every worker, a probe bind is closed again */
+            int probe = http_listener_bind(l, 1);
+            if (-1 == probe) exit(1);
+            close(probe);
+            continue;
+        }
+#endif
+        l->fd = http_listener_open(l, 0);
+        if (-1 == l->fd) exit(1);
+    }
 
-    http_server_free(server);
+    int r;
+    if (http_workers) {
+        r = run_master();
+    }
+    else {
+        r = run_server();
+    }
 
+    http_listeners_free();
     sdsfree(http_address);
     sdsfree(redis_address);
     if (http_socket) sdsfree(http_socket);
     if (redis_socket) sdsfree(redis_socket);
 
-    return 0;
+    return r;
 }
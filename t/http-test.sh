@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# End to end tests: a scratch redis-server and redis-http on spare ports,
+# driven with curl, redis-cli and raw requests over bash's /dev/tcp.
+#
+#   $ make test
+#
+REDIS_PORT=${REDIS_PORT:-16379}
+HTTP_PORT=${HTTP_PORT:-16380}
+URL=http://127.0.0.1:$HTTP_PORT
+DIR=$(mktemp -d)
+failed=0
+n=0
+
+redis-server --port $REDIS_PORT --save '' --dir "$DIR" --daemonize yes \
+    --pidfile "$DIR/redis.pid" >/dev/null || exit 1
+./redis-http --port $HTTP_PORT --redis-port $REDIS_PORT >"$DIR/redis-http.log" 2>&1 &
+HTTP_PID=$!
+
+cleanup() {
+    kill $HTTP_PID 2>/dev/null
+    kill $(cat "$DIR/redis.pid") 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+rcli() {
+    redis-cli -p $REDIS_PORT "$@" >/dev/null
+}
+
+rget() {
+    redis-cli -p $REDIS_PORT "$@"
+}
+
+# send raw request bytes (printf escapes) and print the answer, CRs stripped;
+# the last request has to close the connection
+raw() {
+    exec 3<>/dev/tcp/127.0.0.1/$HTTP_PORT
+    printf "$1" >&3
+    timeout 5 cat <&3 | tr -d '\r'
+    exec 3<&-
+}
+
+# is NAME GOT EXPECTED
+is() {
+    n=$((n + 1))
+    if [ "$2" = "$3" ]; then
+        echo "ok $n - $1"
+    else
+        echo "not ok $n - $1"
+        echo "#   got:      '$2'"
+        echo "#   expected: '$3'"
+        failed=$((failed + 1))
+    fi
+}
+
+# status and header lines of a GET, CRs stripped
+head_of() {
+    curl -s -o /dev/null -D - "$@" | tr -d '\r'
+}
+
+status_of() {
+    curl -s -o /dev/null -w '%{http_code}' "$@"
+}
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    status_of $URL/ >/dev/null && break
+    sleep 0.2
+done
+
+rcli set foo 0123456789
+rcli hset user name Ann
+
+is "GET" "$(curl -s $URL/foo)" "0123456789"
+is "GET missing key" "$(status_of $URL/nokey)" "404"
+is "GET of a hash" "$(status_of $URL/user)" "502"
+
+# hashes
+is "HGET" "$(curl -s $URL/h/user/name)" "Ann"
+is "HGET missing field" "$(status_of $URL/h/user/age)" "404"
+is "HGET of a string" "$(status_of $URL/h/foo/name)" "502"
+is "HMGET of a string" "$(status_of "$URL/h/foo?f=name&f=age")" "502"
+
+# Range
+is "range" "$(curl -s -H 'Range: bytes=2-4' $URL/foo)" "234"
+is "suffix range" "$(curl -s -H 'Range: bytes=-3' $URL/foo)" "789"
+is "range past the end" "$(status_of -H 'Range: bytes=20-' $URL/foo)" "416"
+is "empty suffix range" "$(status_of -H 'Range: bytes=-0' $URL/foo)" "416"
+is "empty suffix Content-Range" \
+    "$(head_of -H 'Range: bytes=-0' $URL/foo | grep '^Content-Range:')" "Content-Range: bytes */10"
+is "empty suffix with a satisfiable range" "$(curl -s -H 'Range: bytes=-0,0-1' $URL/foo)" "01"
+
+# uploads
+is "PUT" "$(status_of -X PUT --data-binary 'put value' $URL/put)" "204"
+is "GET after PUT" "$(curl -s $URL/put)" "put value"
+is "POST" "$(status_of --data-binary 'post value' $URL/post)" "204"
+is "GET after POST" "$(curl -s $URL/post)" "post value"
+
+status_of -X PUT --data-binary x "$URL/ttl?ttl=3600" >/dev/null
+ttl=$(rget ttl ttl)
+is "PUT ?ttl=" "$([ "$ttl" -gt 0 ] && [ "$ttl" -le 3600 ] && echo set)" "set"
+status_of -X PUT -H 'X-TTL: 60' --data-binary x $URL/xttl >/dev/null
+ttl=$(rget ttl xttl)
+is "PUT X-TTL" "$([ "$ttl" -gt 0 ] && [ "$ttl" -le 60 ] && echo set)" "set"
+status_of -X PUT --data-binary x $URL/ttl >/dev/null
+is "PUT without a TTL persists" "$(rget ttl ttl)" "-1"
+
+is "chunked PUT" \
+    "$(printf 'chunked value' | status_of -X PUT -H 'Transfer-Encoding: chunked' --data-binary @- $URL/chunked)" "204"
+is "GET after chunked PUT" "$(curl -s $URL/chunked)" "chunked value"
+
+is "Expect: 100-continue" \
+    "$(curl -s -v -o /dev/null -X PUT -H 'Expect: 100-continue' --data-binary 'continued' $URL/expect 2>&1 |
+        tr -d '\r' | grep -c '^< HTTP/1.1 100 Continue$')" "1"
+is "GET after Expect" "$(curl -s $URL/expect)" "continued"
+
+is "broken chunk size" \
+    "$(raw 'PUT /broken HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n' | head -n 1)" \
+    "HTTP/1.1 400 Bad Request"
+is "missing Content-Length" \
+    "$(raw 'PUT /nolength HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n' | head -n 1)" \
+    "HTTP/1.1 411 Length Required"
+
+rcli set pipelined old
+out=$(raw 'PUT /pipelined HTTP/1.1\r\nHost: x\r\nContent-Length: 3\r\n\r\nnewGET /pipelined HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n')
+is "PUT answer before a pipelined GET" "$(echo "$out" | head -n 1)" "HTTP/1.1 204 No Content"
+is "pipelined GET sees the PUT" "$(echo "$out" | tail -n 1)" "new"
+
+echo "1..$n"
+if [ $failed -ne 0 ]; then
+    echo "# failed $failed of $n"
+    exit 1
+fi